@@ -1,11 +1,18 @@
-﻿#include <array>
+﻿#include <algorithm>
+#include <array>
+#include <limits>
 #include <numeric>
 #include <vector>
 
+#include <kdtree/node_storage.hpp>
 #include <kdtree/point_traits.hpp>
+#include <kdtree/simd.hpp>
 
 namespace kdtree::benchmark {
 
+    // Naive O(N) search over all points. Uses the same structure-of-arrays
+    // coordinates and distance kernels as the tree, so that the comparison
+    // measures the search algorithm rather than the distance code.
     template<point Point>
     class baseline_tree {
     public:
@@ -14,39 +21,39 @@ namespace kdtree::benchmark {
 
         template<points_range Range>
         baseline_tree(Range const& points, auto kdim)
-            : points_(points)
+            : points_(std::ranges::begin(points), std::ranges::end(points))
+            , coords_(detail::make_coordinates(points_, kdim))
             , kdim_(kdim) {}
 
         Point find_nearest(Point const& key) const {
+            const auto kernel = detail::dist_block_kernel<Point>();
+            alignas(coordinate_storage<distance_type>::alignment) detail::dist_block_t<Point> dists;
+
             auto min_dist = std::numeric_limits<distance_type>::max();
-            point_type result;
-            for (const auto& p : points_) {
-                const auto dist = dist_sqr(p, key);
-                if (dist < min_dist) {
-                    min_dist = dist;
-                    result = p;
+            size_t result = 0;
+
+            for (size_t first = 0; first < points_.size(); first += detail::dist_block_size) {
+                const auto count = std::min(detail::dist_block_size, points_.size() - first);
+                const auto block_min = kernel(
+                    coords_.values.data() + first, coords_.stride, key, kdim_, count, dists.data());
+
+                if (block_min >= min_dist) continue;
+
+                for (size_t j = 0; j < count; ++j) {
+                    if (dists[j] < min_dist) {
+                        min_dist = dists[j];
+                        result = first + j;
+                    }
                 }
             }
-            return result;
+
+            return points_.empty() ? point_type{} : points_[result];
         }
 
     private:
         std::vector<Point> points_;
+        coordinate_storage<distance_type> coords_;
         size_t kdim_;
-
-        distance_type dist_sqr(const Point& a, const Point& b) const {
-
-            auto dist = distance_type(0);
-
-            for (auto i = 0; i < kdim_; ++i) {
-                auto ai = a[i];
-                auto bi = b[i];
-                auto di = ai - bi;
-                dist += di * di;
-            }
-
-            return dist;
-        }
     };
 
     template<points_range Points>
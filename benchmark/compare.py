@@ -0,0 +1,118 @@
+#!/usr/bin/env python3
+"""Compares two JSON outputs of kdtree_benchmark and flags regressions.
+
+Make the files with
+
+    kdtree_benchmark --benchmark_out=new.json --benchmark_out_format=json \
+        --benchmark_repetitions=5 --benchmark_report_aggregates_only=true
+
+or the benchmark_json target, then run
+
+    compare.py old.json new.json [--threshold 0.1] [--filter suite_find]
+
+Medians are compared when the runs have repetitions, means of all runs
+otherwise. A benchmark regresses when its time grows by more than the
+threshold, or when one of the search work counters (nodes, dists, far,
+leaves) does, which flags worse pruning however noisy the machine is.
+Exits with 1 if anything regressed.
+"""
+
+import argparse
+import json
+import re
+import sys
+
+TIME_UNITS = {"ns": 1.0, "us": 1e3, "ms": 1e6, "s": 1e9}
+WORK_COUNTERS = ("nodes", "dists", "far", "leaves")
+
+
+def load(path, metric, name_filter):
+    """Returns {name: {"time": ns, counter: value, ...}}."""
+    with open(path) as f:
+        runs = json.load(f)["benchmarks"]
+
+    medians = {}
+    samples = {}
+    for run in runs:
+        name = run.get("run_name", run["name"])
+        if name_filter and not re.search(name_filter, name):
+            continue
+        if run.get("error_occurred"):
+            continue
+
+        values = {"time": run[metric] * TIME_UNITS[run.get("time_unit", "ns")]}
+        values.update({c: run[c] for c in WORK_COUNTERS if c in run})
+
+        if run.get("run_type") == "aggregate":
+            if run.get("aggregate_name") == "median":
+                medians[name] = values
+        else:
+            samples.setdefault(name, []).append(values)
+
+    results = {}
+    for name, values in samples.items():
+        results[name] = {key: sum(v[key] for v in values) / len(values) for key in values[0]}
+    results.update(medians)
+    return results
+
+
+def format_time(ns):
+    for unit in ("s", "ms", "us"):
+        if ns >= TIME_UNITS[unit]:
+            return "%.3g %s" % (ns / TIME_UNITS[unit], unit)
+    return "%.3g ns" % ns
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("baseline")
+    parser.add_argument("contender")
+    parser.add_argument("--threshold", type=float, default=0.1, help="relative change that counts, default 0.1")
+    parser.add_argument("--metric", choices=("real_time", "cpu_time"), default="real_time")
+    parser.add_argument("--filter", help="regular expression for the benchmark names to compare")
+    parser.add_argument("--all", action="store_true", help="also list benchmarks that did not change")
+    args = parser.parse_args()
+
+    old = load(args.baseline, args.metric, args.filter)
+    new = load(args.contender, args.metric, args.filter)
+
+    regressions = 0
+    width = max((len(name) for name in new), default=0)
+
+    for name in sorted(old.keys() & new.keys()):
+        a, b = old[name], new[name]
+        change = b["time"] / a["time"] - 1 if a["time"] > 0 else 0.0
+
+        notes = []
+        status = ""
+        if change > args.threshold:
+            status = "REGRESSION"
+        elif change < -args.threshold:
+            status = "improved"
+
+        for counter in WORK_COUNTERS:
+            if counter in a and counter in b and a[counter] > 0:
+                counter_change = b[counter] / a[counter] - 1
+                if abs(counter_change) > args.threshold:
+                    notes.append("%s %+.1f%%" % (counter, 100 * counter_change))
+                    if counter_change > 0:
+                        status = "REGRESSION"
+
+        regressions += status == "REGRESSION"
+        if status or notes or args.all:
+            line = "%-*s  %10s -> %10s  %+7.1f%%  %s %s" % (
+                width, name, format_time(a["time"]), format_time(b["time"]), 100 * change, status, ", ".join(notes))
+            print(line.rstrip())
+
+    for name in sorted(old.keys() - new.keys()):
+        print("%-*s  missing in %s" % (width, name, args.contender))
+    for name in sorted(new.keys() - old.keys()):
+        print("%-*s  new" % (width, name))
+
+    print("%d of %d benchmarks regressed by more than %.0f%%" % (
+        regressions, len(old.keys() & new.keys()), 100 * args.threshold))
+    return 1 if regressions else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -1,41 +1,37 @@
+﻿#include <algorithm>
 #include <cstdlib>
+#include <filesystem>
+#include <random>
 #include <vector>
 
 #include <benchmark/benchmark.h>
 
 #include <kdtree/point2d.hpp>
+#include <kdtree/dynamic_tree.hpp>
+#include <kdtree/mapped_tree.hpp>
+#include <kdtree/point3d.hpp>
 #include <kdtree/tree.hpp>
 
-#include "point_generator.hpp"
 #include "baseline_tree.hpp"
+#include "measure.hpp"
+#include "point_generator.hpp"
 
 namespace kdtree::benchmark {
 
-    template<class Tree>
-    void measure_find_nearest(
-        ::benchmark::State& state,
-        Tree const& tree,
-        std::vector<typename Tree::point_type> const& points) {
-
-        for (auto _ : state) {
-            for (const auto& p : points) {
-                ::benchmark::DoNotOptimize(tree.find_nearest(p));
-            }
+    // Balanced hand-made tree of points[first, last), nodes come from
+    // make(value, left, right).
+    template<class Point, class Make>
+    node_container_t<Point> make_balanced_nodes(const std::vector<Point>& points, size_t first, size_t last, Make& make) {
+        if (first == last) {
+            return make_leaf<Point>();
         }
+        const auto mid = first + (last - first) / 2;
+        return make(points[mid], make_balanced_nodes(points, first, mid, make), make_balanced_nodes(points, mid + 1, last, make));
     }
 
-    template<points_range Points>
-    void measure_build_tree(
-        ::benchmark::State& state,
-        const Points& points) {
-
-        for (auto _ : state) {
-            build_tree(points);
-        }
-    }
-
-    std::vector<float2> make_point_cloud(size_t count, float2 origin, float2 sigma, auto seed) {
-        std::vector<float2> points(count);
+    template<point Point = float2>
+    std::vector<Point> make_point_cloud(size_t count, Point origin, Point sigma, auto seed) {
+        std::vector<Point> points(count);
         std::fill(points.begin(), points.end(), origin);
         add_noise(points, points, sigma, seed);
         return points;
@@ -52,6 +48,33 @@ namespace kdtree::benchmark {
         std::vector<float2> key_points;
     };
 
+    class SpherialClouds3d : public ::benchmark::Fixture {
+    public:
+        void SetUp(const ::benchmark::State& state) {
+            tree_points = make_point_cloud(state.range(0), float3{ 0, 0, 0 }, float3{ 1, 1, 1 }, 42);
+            key_points = make_point_cloud(1000, float3{ 0, 0, 0 }, float3{ 1, 1, 1 }, 142);
+        }
+
+        std::vector<float3> tree_points;
+        std::vector<float3> key_points;
+    };
+
+    // std::vector points with the dimension as the second argument
+    class VectorClouds : public ::benchmark::Fixture {
+    public:
+        void SetUp(const ::benchmark::State& state) {
+            kdim = int(state.range(1));
+            const std::vector<float> origin(kdim, 0.f);
+            const std::vector<float> sigma(kdim, 1.f);
+            tree_points = make_point_cloud(state.range(0), origin, sigma, 42);
+            key_points = make_point_cloud(1000, origin, sigma, 142);
+        }
+
+        int kdim = 0;
+        std::vector<std::vector<float>> tree_points;
+        std::vector<std::vector<float>> key_points;
+    };
+
     class DistantSpherialClouds : public ::benchmark::Fixture {
     public:
         void SetUp(const ::benchmark::State& state) {
@@ -90,6 +113,27 @@ namespace kdtree::benchmark {
     }
     BENCHMARK_REGISTER_F(SpherialClouds, tree_build)->Range(1024, 1 << 17);
 
+    BENCHMARK_DEFINE_F(SpherialClouds, tree_build_parallel)(::benchmark::State& state) {
+
+        for (auto _ : state) {
+            build_tree(tree_points, { .threads = size_t(state.range(1)) });
+        }
+    }
+    BENCHMARK_REGISTER_F(SpherialClouds, tree_build_parallel)->ArgsProduct({
+        ::benchmark::CreateRange(1 << 14, 1 << 20, 8),
+        { 1, 2, 4, 8 } })->UseRealTime()->Unit(::benchmark::kMillisecond);
+
+    BENCHMARK_DEFINE_F(SpherialClouds, tree_build_method)(::benchmark::State& state) {
+
+        const build_options options{ .method = build_method(state.range(1)) };
+        for (auto _ : state) {
+            build_tree(tree_points, options);
+        }
+    }
+    BENCHMARK_REGISTER_F(SpherialClouds, tree_build_method)->ArgsProduct({
+        ::benchmark::CreateRange(1 << 10, 1 << 24, 16),
+        { 0, 1 } })->Unit(::benchmark::kMillisecond);
+
     BENCHMARK_DEFINE_F(SpherialClouds, baseline_tree_find)(::benchmark::State& state) {
 
         const auto tree{ build_baseline_tree(tree_points) };
@@ -104,6 +148,235 @@ namespace kdtree::benchmark {
     }
     BENCHMARK_REGISTER_F(SpherialClouds, tree_find)->Range(1024, 1 << 17);
 
+    // Search after erasing the given percentage of points, without
+    // compaction (second argument 0) or with the default one (1).
+    BENCHMARK_DEFINE_F(SpherialClouds, tree_find_erased)(::benchmark::State& state) {
+
+        const auto compact = state.range(2) != 0;
+        auto tree{ build_tree(tree_points, { .compact_fraction = compact ? build_options{}.compact_fraction : 1.0 }) };
+
+        auto erased = tree_points;
+        std::shuffle(erased.begin(), erased.end(), std::default_random_engine(7));
+        erased.resize(erased.size() * state.range(1) / 100);
+        for (const auto& p : erased) {
+            tree.erase(p);
+        }
+
+        measure_find_nearest(state, tree, key_points);
+    }
+    BENCHMARK_REGISTER_F(SpherialClouds, tree_find_erased)->ArgsProduct({
+        { 1 << 17 },
+        { 0, 25, 50, 75, 95 },
+        { 0, 1 } });
+
+    // Makes and drops a hand-made tree of all points, with make_node
+    // (second argument 0) or with a node_arena per tree (1).
+    BENCHMARK_DEFINE_F(SpherialClouds, node_tree_make)(::benchmark::State& state) {
+
+        const auto use_arena = state.range(1) != 0;
+        for (auto _ : state) {
+            if (use_arena) {
+                node_arena<float2> arena;
+                auto make = [&arena](const float2& p, auto left, auto right) {
+                    return arena.make_node(p, std::move(left), std::move(right));
+                };
+                ::benchmark::DoNotOptimize(make_balanced_nodes(tree_points, 0, tree_points.size(), make));
+            }
+            else {
+                auto make = [](const float2& p, auto left, auto right) {
+                    return make_node(p, std::move(left), std::move(right));
+                };
+                ::benchmark::DoNotOptimize(make_balanced_nodes(tree_points, 0, tree_points.size(), make));
+            }
+        }
+        state.SetItemsProcessed(state.iterations() * tree_points.size());
+    }
+    BENCHMARK_REGISTER_F(SpherialClouds, node_tree_make)->ArgsProduct({
+        ::benchmark::CreateRange(1024, 1 << 20, 32),
+        { 0, 1 } });
+
+    // Opening a saved tree, to be compared with tree_build.
+    BENCHMARK_DEFINE_F(SpherialClouds, mapped_tree_open)(::benchmark::State& state) {
+
+        const auto path = std::filesystem::temp_directory_path() / "kdtree_benchmark.kdt";
+        save_tree(build_tree(tree_points), path);
+
+        for (auto _ : state) {
+            const mapped_tree<float2> tree(path);
+            ::benchmark::DoNotOptimize(tree.size());
+        }
+
+        std::filesystem::remove(path);
+    }
+    BENCHMARK_REGISTER_F(SpherialClouds, mapped_tree_open)->Range(1024, 1 << 20);
+
+    BENCHMARK_DEFINE_F(SpherialClouds, mapped_tree_find)(::benchmark::State& state) {
+
+        const auto path = std::filesystem::temp_directory_path() / "kdtree_benchmark.kdt";
+        save_tree(build_tree(tree_points), path);
+
+        const mapped_tree<float2> tree(path);
+        measure_find_nearest(state, tree, key_points);
+
+        std::filesystem::remove(path);
+    }
+    BENCHMARK_REGISTER_F(SpherialClouds, mapped_tree_find)->Range(1024, 1 << 17);
+
+    // Inserts all points one by one, items are insertions.
+    BENCHMARK_DEFINE_F(SpherialClouds, dynamic_tree_insert)(::benchmark::State& state) {
+
+        for (auto _ : state) {
+            dynamic_tree<float2> tree(2, { .leaf_size = size_t(state.range(1)) });
+            for (const auto& p : tree_points) {
+                tree.insert(p);
+            }
+            ::benchmark::DoNotOptimize(tree.size());
+        }
+        state.SetItemsProcessed(state.iterations() * tree_points.size());
+    }
+    BENCHMARK_REGISTER_F(SpherialClouds, dynamic_tree_insert)->ArgsProduct({
+        ::benchmark::CreateRange(1024, 1 << 17, 8),
+        { 1, 16 } });
+
+    // Search in a dynamic tree grown by insertion, to be compared with
+    // tree_find_bucket of the same leaf size.
+    BENCHMARK_DEFINE_F(SpherialClouds, dynamic_tree_find)(::benchmark::State& state) {
+
+        dynamic_tree<float2> tree(2, { .leaf_size = size_t(state.range(1)) });
+        for (const auto& p : tree_points) {
+            tree.insert(p);
+        }
+        measure_find_nearest(state, tree, key_points);
+    }
+    BENCHMARK_REGISTER_F(SpherialClouds, dynamic_tree_find)->ArgsProduct({
+        ::benchmark::CreateRange(1024, 1 << 17, 8),
+        { 1, 16 } });
+
+    BENCHMARK_DEFINE_F(SpherialClouds, tree_find_bucket)(::benchmark::State& state) {
+
+        const auto tree{ build_tree(tree_points, state.range(1)) };
+        measure_find_nearest(state, tree, key_points);
+    }
+    BENCHMARK_REGISTER_F(SpherialClouds, tree_find_bucket)->ArgsProduct({
+        ::benchmark::CreateRange(1024, 1 << 17, 8),
+        { 1, 8, 16, 32, 64 } });
+
+    BENCHMARK_DEFINE_F(SpherialClouds3d, tree_find_aos)(::benchmark::State& state) {
+
+        const auto tree{ build_tree(tree_points, {
+            .leaf_size = size_t(state.range(1)),
+            .layout = coordinate_layout::aos }) };
+        measure_find_nearest(state, tree, key_points);
+    }
+    BENCHMARK_REGISTER_F(SpherialClouds3d, tree_find_aos)->ArgsProduct({
+        ::benchmark::CreateRange(1024, 1 << 17, 8),
+        { 8, 16, 32, 64 } });
+
+    BENCHMARK_DEFINE_F(SpherialClouds3d, tree_find_soa)(::benchmark::State& state) {
+
+        const auto tree{ build_tree(tree_points, {
+            .leaf_size = size_t(state.range(1)),
+            .layout = coordinate_layout::soa }) };
+        measure_find_nearest(state, tree, key_points);
+    }
+    BENCHMARK_REGISTER_F(SpherialClouds3d, tree_find_soa)->ArgsProduct({
+        ::benchmark::CreateRange(1024, 1 << 17, 8),
+        { 8, 16, 32, 64 } });
+
+    BENCHMARK_DEFINE_F(SpherialClouds, tree_find_batch)(::benchmark::State& state) {
+
+        const auto tree{ build_tree(tree_points) };
+        std::vector<float2> out(key_points.size());
+        for (auto _ : state) {
+            tree.find_nearest_batch(key_points, out, { .threads = size_t(state.range(1)), .chunk_size = 64 });
+            ::benchmark::DoNotOptimize(out.data());
+        }
+    }
+    BENCHMARK_REGISTER_F(SpherialClouds, tree_find_batch)->ArgsProduct({
+        ::benchmark::CreateRange(1024, 1 << 17, 8),
+        { 1, 2, 4, 8 } })->UseRealTime();
+
+    BENCHMARK_DEFINE_F(SpherialClouds3d, tree_find_n)(::benchmark::State& state) {
+
+        const auto tree{ build_tree(tree_points, 16) };
+        const auto num = size_t(state.range(1));
+        for (auto _ : state) {
+            for (const auto& p : key_points) {
+                ::benchmark::DoNotOptimize(tree.find_nearest_n(p, num));
+            }
+        }
+    }
+    BENCHMARK_REGISTER_F(SpherialClouds3d, tree_find_n)->ArgsProduct({
+        ::benchmark::CreateRange(1024, 1 << 17, 8),
+        { 1, 8, 32, 64, 128, 256 } });
+
+    BENCHMARK_DEFINE_F(SpherialClouds3d, tree_find_n_neighbors)(::benchmark::State& state) {
+
+        const auto tree{ build_tree(tree_points, 16) };
+        std::vector<kdtree::tree<float3>::neighbor_type> out(state.range(1));
+        for (auto _ : state) {
+            for (const auto& p : key_points) {
+                ::benchmark::DoNotOptimize(tree.find_nearest_neighbors(p, out));
+            }
+        }
+    }
+    BENCHMARK_REGISTER_F(SpherialClouds3d, tree_find_n_neighbors)->ArgsProduct({
+        ::benchmark::CreateRange(1024, 1 << 17, 8),
+        { 1, 8, 32, 64, 128, 256 } });
+
+    // Speed against recall of approximate search, eps is the second
+    // argument in percent. Recall is the share of keys for which the
+    // exact nearest distance is found.
+    template<class Tree>
+    void measure_find_nearest_approx(
+        ::benchmark::State& state,
+        Tree const& tree,
+        std::vector<typename Tree::point_type> const& points) {
+
+        const auto eps = state.range(1) / 100.0;
+        const auto kdim = point_kdim_v<typename Tree::point_type>;
+
+        for (auto _ : state) {
+            for (const auto& p : points) {
+                ::benchmark::DoNotOptimize(tree.find_nearest(p, eps));
+            }
+        }
+
+        size_t hits = 0;
+        for (const auto& p : points) {
+            hits += detail::dist_sqr(p, tree.find_nearest(p, eps), kdim) == detail::dist_sqr(p, tree.find_nearest(p), kdim);
+        }
+        state.counters["recall"] = double(hits) / points.size();
+        report_search_stats(state, tree, points, eps);
+    }
+
+    BENCHMARK_DEFINE_F(SpherialClouds3d, tree_find_approx)(::benchmark::State& state) {
+
+        const auto tree{ build_tree(tree_points) };
+        measure_find_nearest_approx(state, tree, key_points);
+    }
+    BENCHMARK_REGISTER_F(SpherialClouds3d, tree_find_approx)->ArgsProduct({
+        { 1 << 17 },
+        { 0, 1, 5, 10, 50, 100 } });
+
+    BENCHMARK_DEFINE_F(NormalLines, tree_find_approx)(::benchmark::State& state) {
+
+        const auto tree{ build_tree(tree_points) };
+        measure_find_nearest_approx(state, tree, key_points);
+    }
+    BENCHMARK_REGISTER_F(NormalLines, tree_find_approx)->ArgsProduct({
+        { 1 << 17 },
+        { 0, 1, 5, 10, 50, 100 } });
+
+    BENCHMARK_DEFINE_F(VectorClouds, tree_find)(::benchmark::State& state) {
+
+        const auto tree{ kdtree::tree<std::vector<float>>::build(tree_points, kdim, 16) };
+        measure_find_nearest(state, tree, key_points);
+    }
+    BENCHMARK_REGISTER_F(VectorClouds, tree_find)->ArgsProduct({
+        { 1 << 14, 1 << 17 },
+        { 3, 5, 8, 16 } });
+
     BENCHMARK_DEFINE_F(DistantSpherialClouds, tree_find)(::benchmark::State& state) {
 
         const auto tree{ build_tree(tree_points) };
@@ -111,6 +384,19 @@ namespace kdtree::benchmark {
     }
     BENCHMARK_REGISTER_F(DistantSpherialClouds, tree_find)->Range(1024, 1 << 17);
 
+    BENCHMARK_DEFINE_F(DistantSpherialClouds, tree_find_batch)(::benchmark::State& state) {
+
+        const auto tree{ build_tree(tree_points) };
+        std::vector<float2> out(key_points.size());
+        for (auto _ : state) {
+            tree.find_nearest_batch(key_points, out, { .threads = size_t(state.range(1)), .chunk_size = 64 });
+            ::benchmark::DoNotOptimize(out.data());
+        }
+    }
+    BENCHMARK_REGISTER_F(DistantSpherialClouds, tree_find_batch)->ArgsProduct({
+        ::benchmark::CreateRange(1024, 1 << 17, 8),
+        { 1, 2, 4, 8 } })->UseRealTime();
+
     BENCHMARK_DEFINE_F(ParallelLines, tree_find)(::benchmark::State& state) {
 
         const auto tree{ build_tree(tree_points) };
@@ -124,6 +410,25 @@ namespace kdtree::benchmark {
         measure_find_nearest(state, tree, key_points);
     }
     BENCHMARK_REGISTER_F(NormalLines, tree_find)->Range(1024, 1 << 17);
+
+    // split rule is the second argument, see split_rule
+    BENCHMARK_DEFINE_F(ParallelLines, tree_find_split)(::benchmark::State& state) {
+
+        const auto tree{ build_tree(tree_points, { .split = split_rule(state.range(1)) }) };
+        measure_find_nearest(state, tree, key_points);
+    }
+    BENCHMARK_REGISTER_F(ParallelLines, tree_find_split)->ArgsProduct({
+        ::benchmark::CreateRange(1024, 1 << 17, 8),
+        { 0, 1, 2 } });
+
+    BENCHMARK_DEFINE_F(NormalLines, tree_find_split)(::benchmark::State& state) {
+
+        const auto tree{ build_tree(tree_points, { .split = split_rule(state.range(1)) }) };
+        measure_find_nearest(state, tree, key_points);
+    }
+    BENCHMARK_REGISTER_F(NormalLines, tree_find_split)->ArgsProduct({
+        ::benchmark::CreateRange(1024, 1 << 17, 8),
+        { 0, 1, 2 } });
 }
 
 BENCHMARK_MAIN();
\ No newline at end of file
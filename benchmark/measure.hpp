@@ -0,0 +1,64 @@
+﻿#pragma once
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include <kdtree/point_traits.hpp>
+#include <kdtree/search_stats.hpp>
+#include <kdtree/tree.hpp>
+
+namespace kdtree::benchmark {
+
+    // Average work per query as counters, for trees that report it, so
+    // that changes in pruning show up next to the timings. Measured in a
+    // separate pass, the timed queries do not count anything.
+    template<class Tree>
+    void report_search_stats(
+        ::benchmark::State& state,
+        Tree const& tree,
+        std::vector<typename Tree::point_type> const& points,
+        const double eps = 0) {
+
+        if constexpr (requires(search_stats& stats) { tree.find_nearest_neighbor(points.front(), stats, eps); }) {
+            if (points.empty()) {
+                return;
+            }
+
+            search_stats stats;
+            for (const auto& p : points) {
+                tree.find_nearest_neighbor(p, stats, eps);
+            }
+
+            const auto per_query = [&points](size_t value) { return double(value) / points.size(); };
+            state.counters["nodes"] = per_query(stats.nodes_visited);
+            state.counters["dists"] = per_query(stats.distance_evaluations);
+            state.counters["far"] = per_query(stats.far_descents);
+            state.counters["leaves"] = per_query(stats.leaf_scans);
+            state.counters["stack"] = double(stats.max_stack_depth);
+        }
+    }
+
+    template<class Tree>
+    void measure_find_nearest(
+        ::benchmark::State& state,
+        Tree const& tree,
+        std::vector<typename Tree::point_type> const& points) {
+
+        for (auto _ : state) {
+            for (const auto& p : points) {
+                ::benchmark::DoNotOptimize(tree.find_nearest(p));
+            }
+        }
+        report_search_stats(state, tree, points);
+    }
+
+    template<points_range Points>
+    void measure_build_tree(
+        ::benchmark::State& state,
+        const Points& points) {
+
+        for (auto _ : state) {
+            build_tree(points);
+        }
+    }
+}
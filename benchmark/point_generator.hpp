@@ -1,6 +1,10 @@
 #pragma once
 #include <algorithm>
+#include <array>
 #include <random>
+#include <ranges>
+#include <type_traits>
+#include <vector>
 
 #include <kdtree/point_traits.hpp>
 
@@ -29,4 +33,111 @@ namespace kdtree::benchmark {
 
         std::transform(std::ranges::begin(src), std::ranges::end(src), std::ranges::begin(dst), add_noise_to_point);
     }
-}
\ No newline at end of file
+
+    // Point sets of the benchmark suite. Coordinates lie in about [-1, 1]
+    // along every axis, [-1000, 1000] for integer points. The clusters,
+    // distinct points and plane are the same for every seed, so keys made
+    // with another seed follow the tree points.
+    enum class distribution {
+        uniform,
+        clustered,  // 16 tight normal clusters
+        duplicates,  // 64 distinct points, each repeated many times
+        sorted,  // uniform, in lexicographic order
+        low_dimensional,  // noisy plane through all dimensions
+    };
+
+    inline constexpr std::array all_distributions{
+        distribution::uniform,
+        distribution::clustered,
+        distribution::duplicates,
+        distribution::sorted,
+        distribution::low_dimensional,
+    };
+
+    inline const char* distribution_name(const distribution d) {
+        switch (d) {
+        case distribution::uniform: return "uniform";
+        case distribution::clustered: return "clustered";
+        case distribution::duplicates: return "duplicates";
+        case distribution::sorted: return "sorted";
+        case distribution::low_dimensional: return "low_dimensional";
+        }
+        return "";
+    }
+
+    template<static_kdim_point Point>
+    std::vector<Point> make_points(const distribution d, const size_t count, const unsigned seed) {
+
+        using coordinate_t = std::ranges::range_value_t<Point>;
+        using coordinates_t = std::array<double, point_kdim_v<Point>>;
+
+        constexpr double scale = std::is_integral_v<coordinate_t> ? 1000 : 1;
+
+        std::default_random_engine rng(seed);
+        std::default_random_engine shape_rng(7);
+        std::uniform_real_distribution<double> ud(-1, 1);
+        std::normal_distribution<double> nd;
+
+        const auto uniform_with = [&ud](std::default_random_engine& engine) {
+            coordinates_t x;
+            std::ranges::generate(x, [&]() { return ud(engine); });
+            return x;
+        };
+        const auto uniform = [&]() { return uniform_with(rng); };
+        const auto shape = [&]() { return uniform_with(shape_rng); };
+
+        const auto to_point = [](const coordinates_t& x) {
+            Point p;
+            std::ranges::transform(x, p.begin(), [](double c) { return coordinate_t(c * scale); });
+            return p;
+        };
+
+        std::vector<Point> points(count);
+
+        switch (d) {
+        case distribution::uniform:
+        case distribution::sorted:
+            std::ranges::generate(points, [&]() { return to_point(uniform()); });
+            if (d == distribution::sorted) {
+                std::ranges::sort(points);
+            }
+            break;
+
+        case distribution::clustered: {
+            std::vector<coordinates_t> centers(16);
+            std::ranges::generate(centers, shape);
+            for (auto& p : points) {
+                auto x = centers[rng() % centers.size()];
+                std::ranges::for_each(x, [&](double& c) { c += 0.02 * nd(rng); });
+                p = to_point(x);
+            }
+            break;
+        }
+
+        case distribution::duplicates: {
+            std::vector<Point> distinct(64);
+            std::ranges::generate(distinct, [&]() { return to_point(shape()); });
+            std::ranges::generate(points, [&]() { return distinct[rng() % distinct.size()]; });
+            break;
+        }
+
+        case distribution::low_dimensional: {
+            // x = u * a + v * b with |a[i]| + |b[i]| <= 1
+            const auto a = shape();
+            const auto b = shape();
+            for (auto& p : points) {
+                const auto u = ud(rng) / 2;
+                const auto v = ud(rng) / 2;
+                coordinates_t x;
+                for (size_t i = 0; i < x.size(); ++i) {
+                    x[i] = u * a[i] + v * b[i] + 0.001 * nd(rng);
+                }
+                p = to_point(x);
+            }
+            break;
+        }
+        }
+
+        return points;
+    }
+}
@@ -0,0 +1,106 @@
+﻿#include <array>
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include <kdtree/point2d.hpp>
+#include <kdtree/point3d.hpp>
+#include <kdtree/tree.hpp>
+
+#include "baseline_tree.hpp"
+#include "measure.hpp"
+#include "point_generator.hpp"
+
+// Benchmarks of every point type below against every distribution, named
+// suite_<query>/<point>/<distribution>/<size>[/<k>]. Keys are drawn from
+// the same distribution as the tree points, with another seed.
+namespace kdtree::benchmark {
+
+    using float8 = std::array<float, 8>;
+    using float32 = std::array<float, 32>;
+
+    template<class Point>
+    std::string point_name() {
+        using coordinate_t = std::ranges::range_value_t<Point>;
+        const std::string type = std::is_same_v<coordinate_t, int> ? "int" : std::is_same_v<coordinate_t, float> ? "float" : "double";
+        return type + std::to_string(point_kdim_v<Point>);
+    }
+
+    constexpr size_t suite_keys = 1000;
+
+    template<class Point>
+    void suite_find(::benchmark::State& state, const distribution d) {
+        const auto tree{ build_tree(make_points<Point>(d, size_t(state.range(0)), 42)) };
+        measure_find_nearest(state, tree, make_points<Point>(d, suite_keys, 142));
+    }
+
+    template<class Point>
+    void suite_find_n(::benchmark::State& state, const distribution d) {
+        const auto tree{ build_tree(make_points<Point>(d, size_t(state.range(0)), 42)) };
+        const auto keys = make_points<Point>(d, suite_keys, 142);
+
+        std::vector<typename tree<Point>::neighbor_type> out(size_t(state.range(1)));
+        for (auto _ : state) {
+            for (const auto& key : keys) {
+                ::benchmark::DoNotOptimize(tree.find_nearest_neighbors(key, out));
+            }
+        }
+    }
+
+    template<class Point>
+    void suite_build(::benchmark::State& state, const distribution d) {
+        measure_build_tree(state, make_points<Point>(d, size_t(state.range(0)), 42));
+        state.SetItemsProcessed(state.iterations() * state.range(0));
+    }
+
+    // The tree and the linear scan on small sets, to find the size from
+    // which the tree pays off.
+    template<class Point>
+    void suite_crossover_tree(::benchmark::State& state) {
+        suite_find<Point>(state, distribution::uniform);
+    }
+
+    template<class Point>
+    void suite_crossover_baseline(::benchmark::State& state) {
+        const auto tree{ build_baseline_tree(make_points<Point>(distribution::uniform, size_t(state.range(0)), 42)) };
+        measure_find_nearest(state, tree, make_points<Point>(distribution::uniform, suite_keys, 142));
+    }
+
+    template<class Point>
+    void register_suite(const size_t max_build_size, const bool find_n) {
+        const auto point = point_name<Point>();
+
+        for (const auto d : all_distributions) {
+            const auto suffix = point + "/" + distribution_name(d);
+
+            ::benchmark::RegisterBenchmark(("suite_find/" + suffix).c_str(), suite_find<Point>, d)
+                ->Arg(1 << 10)->Arg(1 << 14)->Arg(1 << 17);
+
+            ::benchmark::RegisterBenchmark(("suite_build/" + suffix).c_str(), suite_build<Point>, d)
+                ->RangeMultiplier(16)->Range(1 << 10, int64_t(max_build_size))->Unit(::benchmark::kMillisecond);
+
+            if (find_n) {
+                ::benchmark::RegisterBenchmark(("suite_find_n/" + suffix).c_str(), suite_find_n<Point>, d)
+                    ->ArgsProduct({ { 1 << 17 }, { 1, 8, 64 } });
+            }
+        }
+
+        ::benchmark::RegisterBenchmark(("suite_crossover/tree/" + point).c_str(), suite_crossover_tree<Point>)
+            ->RangeMultiplier(2)->Range(8, 1 << 12);
+        ::benchmark::RegisterBenchmark(("suite_crossover/baseline/" + point).c_str(), suite_crossover_baseline<Point>)
+            ->RangeMultiplier(2)->Range(8, 1 << 12);
+    }
+
+    const bool suite_registered = []() {
+        register_suite<int2>(1 << 20, false);
+        register_suite<float2>(1 << 24, false);
+        register_suite<double2>(1 << 20, false);
+        register_suite<int3>(1 << 20, false);
+        register_suite<float3>(1 << 24, true);
+        register_suite<double3>(1 << 20, false);
+        register_suite<float8>(1 << 20, true);
+        register_suite<float32>(1 << 20, true);
+        return true;
+    }();
+}
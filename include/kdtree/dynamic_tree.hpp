@@ -0,0 +1,213 @@
+#pragma once
+
+#include "tree.hpp"
+#include "tree_detail.hpp"
+#include "point_traits.hpp"
+
+#include <bit>
+#include <cstddef>
+#include <limits>
+#include <span>
+#include <vector>
+
+namespace kdtree {
+
+    // Tree that grows by insertion, after Bentley and Saxe: level i is
+    // either empty or a static tree of exactly 2^i points. Inserting a point
+    // merges it with the full levels below the first empty one into a tree
+    // on that level, so every point is rebuilt O(log n) times and insertion
+    // takes amortized O(log^2 n). Queries search the levels from the largest
+    // down and carry the best distances found so far from level to level,
+    // so small levels are mostly pruned at their root.
+    template<point Point>
+    class dynamic_tree {
+    public:
+
+        using point_type = Point;
+        using distance_type = point_distance_t<Point>;
+        using neighbor_type = neighbor<Point, distance_type>;
+
+        // kdim is 0 or point_kdim_v for points that have it, see tree
+        dynamic_tree(const int kdim = 0, const build_options& options = {})
+            : kdim_(detail::make_kdim<Point>(kdim))
+            , options_(options) {
+            options_.leaf_size = std::max<size_t>(options_.leaf_size, 1);
+        }
+
+        // Fills the levels of the binary representation of points.size().
+        template<points_range Points>
+        requires std::same_as<points_range_point_t<Points>, Point>
+        static dynamic_tree build(const Points& points, int kdim, const build_options& options = {}) {
+            dynamic_tree result(kdim, options);
+
+            const auto length = size_t(std::ranges::size(points));
+            auto it = std::ranges::begin(points);
+
+            result.levels_.resize(std::bit_width(length));
+            for (auto level = result.levels_.size(); level-- > 0;) {
+                if (length & (size_t(1) << level)) {
+                    std::vector<Point> level_points;
+                    level_points.reserve(size_t(1) << level);
+                    for (size_t i = 0; i < (size_t(1) << level); ++i, ++it) {
+                        level_points.push_back(*it);
+                    }
+                    result.levels_[level] = result.build_level(std::move(level_points));
+                }
+            }
+
+            result.size_ = length;
+            return result;
+        }
+
+        void insert(const Point& point) {
+            std::vector<Point> points{ point };
+
+            size_t level = 0;
+            for (; level < levels_.size() && !levels_[level].is_empty(); ++level) {
+                auto storage = levels_[level].release();
+                std::ranges::move(storage.points, std::back_inserter(points));
+            }
+
+            if (level == levels_.size()) {
+                levels_.emplace_back(int(kdim_));
+            }
+
+            levels_[level] = build_level(std::move(points));
+            ++size_;
+        }
+
+        size_t size() const {
+            return size_;
+        }
+
+        bool is_empty() const {
+            return size_ == 0;
+        }
+
+        int kdim() const {
+            return int(kdim_);
+        }
+
+        // Static trees by level, level i is empty or has 2^i points.
+        std::span<const tree<Point>> levels() const {
+            return levels_;
+        }
+
+        Point find_nearest(const Point& key, const double eps = 0) const {
+            return find_nearest_neighbor(key, eps).value;
+        }
+
+        // See tree::find_nearest_neighbor.
+        neighbor_type find_nearest_neighbor(const Point& key, const double eps = 0) const {
+            neighbor_type best{ Point{}, std::numeric_limits<distance_type>::max() };
+
+            detail::dispatch_kdim(kdim_, [&](const auto& dim) {
+                const auto prune_scale = detail::make_prune_scale<Point>(eps);
+
+                for (auto level = levels_.size(); level-- > 0;) {
+                    const auto& storage = levels_[level].storage();
+                    if (storage.nodes.empty()) {
+                        continue;
+                    }
+
+                    const auto [index, dist] = detail::find_nearest_iter(
+                        storage, key, dim, options_.leaf_size, prune_scale,
+                        detail::find_result_t<Point>{ 0, best.distance_sqr });
+
+                    if (dist < best.distance_sqr) {
+                        best = { storage.points[index], dist };
+                    }
+                }
+            });
+
+            return best;
+        }
+
+        std::vector<Point> find_nearest_n(const Point& key, const auto& num, const double eps = 0) const {
+            const auto& results = find_nearest_n_results(key, num, eps);
+            std::vector<Point> points(results.size());
+            std::ranges::transform(results, points.begin(), [this](const auto& res) { return point_at(res.first); });
+            return points;
+        }
+
+        // See tree::find_nearest_neighbors.
+        size_t find_nearest_neighbors(const Point& key, std::span<neighbor_type> out, const double eps = 0) const {
+            const auto& results = find_nearest_n_results(key, out.size(), eps);
+            std::ranges::transform(results, out.begin(),
+                [this](const auto& res) { return neighbor_type{ point_at(res.first), res.second }; });
+            return results.size();
+        }
+
+        template<class Visitor>
+        requires std::invocable<Visitor&, const Point&>
+        void visit_within_radius(const Point& key, const distance_type& radius, Visitor&& visitor) const {
+            for (const auto& level : levels_) {
+                level.visit_within_radius(key, radius, visitor);
+            }
+        }
+
+        std::vector<Point> find_within_radius(const Point& key, const distance_type& radius) const {
+            std::vector<Point> out;
+            visit_within_radius(key, radius, [&out](const Point& p) { out.push_back(p); });
+            return out;
+        }
+
+        size_t count_within_radius(const Point& key, const distance_type& radius) const {
+            size_t count = 0;
+            for (const auto& level : levels_) {
+                count += level.count_within_radius(key, radius);
+            }
+            return count;
+        }
+
+    private:
+        tree<Point> build_level(std::vector<Point>&& points) const {
+            return tree<Point>::build(std::move(points), int(kdim_), options_);
+        }
+
+        // Candidates of level i are numbered from 2^i - 1, as if all levels
+        // below it were full, so a number alone tells the level.
+        static size_t level_offset(size_t level) {
+            return (size_t(1) << level) - 1;
+        }
+
+        const Point& point_at(size_t index) const {
+            const auto level = size_t(std::bit_width(index + 1)) - 1;
+            return levels_[level].storage().points[index - level_offset(level)];
+        }
+
+        const detail::find_result_vector_t<Point>& find_nearest_n_results(
+            const Point& key, const auto& num, const double eps) const {
+
+            auto& results = detail::thread_result_heap<Point>();
+            results.reset(std::min<size_t>(num, size_));
+
+            if (results.capacity() > 0) {
+                detail::dispatch_kdim(kdim_, [&](const auto& dim) {
+                    const auto prune_scale = detail::make_prune_scale<Point>(eps);
+
+                    for (auto level = levels_.size(); level-- > 0;) {
+                        if (!levels_[level].is_empty()) {
+                            results.set_offset(level_offset(level));
+                            detail::find_nearest_n_iter(
+                                levels_[level].storage(), key, dim, options_.leaf_size, prune_scale, results);
+                        }
+                    }
+                });
+            }
+
+            return results.sort();
+        }
+
+        std::vector<tree<Point>> levels_;
+        size_t size_ = 0;
+        [[no_unique_address]] detail::kdim_type_t<Point> kdim_;
+        build_options options_;
+    };
+
+    template<points_range Points>
+    dynamic_tree<points_range_point_t<Points>> build_dynamic_tree(const Points& points, const build_options& options = {}) {
+        using point_t = points_range_point_t<Points>;
+        return dynamic_tree<point_t>::build(points, point_kdim_v<point_t>, options);
+    }
+}
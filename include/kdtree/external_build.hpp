@@ -0,0 +1,340 @@
+#pragma once
+
+#include "mapped_tree.hpp"
+#include "node_storage.hpp"
+#include "tree_detail.hpp"
+#include "point_traits.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <vector>
+
+namespace kdtree {
+
+    struct external_build_options {
+        size_t memory_budget = size_t(1) << 30;  // bytes of points and records held in memory at a time
+        size_t sample_size = size_t(1) << 16;  // points sampled to choose each out-of-core split
+        std::filesystem::path temp_directory;  // empty for std::filesystem::temp_directory_path()
+    };
+
+    namespace detail {
+
+        // Temporary point files of an external build, removed at the latest
+        // when the build ends, also by an exception.
+        class scratch_files {
+        public:
+            explicit scratch_files(std::filesystem::path directory)
+                : directory_(directory.empty() ? std::filesystem::temp_directory_path() : std::move(directory))
+                , prefix_("kdtree_build_" + std::to_string(std::random_device()()) + "_") {}
+
+            scratch_files(const scratch_files&) = delete;
+            scratch_files& operator=(const scratch_files&) = delete;
+
+            ~scratch_files() {
+                for (const auto& file : files_) {
+                    std::error_code ec;
+                    std::filesystem::remove(file, ec);
+                }
+            }
+
+            std::filesystem::path make() {
+                files_.push_back(directory_ / (prefix_ + std::to_string(counter_++) + ".tmp"));
+                return files_.back();
+            }
+
+            void remove(const std::filesystem::path& file) {
+                const auto it = std::ranges::find(files_, file);
+                if (it != files_.end()) {
+                    std::filesystem::remove(file);
+                    files_.erase(it);
+                }
+            }
+
+        private:
+            std::filesystem::path directory_;
+            std::string prefix_;
+            size_t counter_ = 0;
+            std::vector<std::filesystem::path> files_;
+        };
+
+        // Reads the points of a point file in consecutive chunks of up to
+        // chunk_size, calling fn(std::span<const Point>) for each.
+        template<class Point, class Fn>
+        void for_each_chunk(const std::filesystem::path& file, const size_t count, const size_t chunk_size, Fn&& fn) {
+            std::ifstream in(file, std::ios::binary);
+            std::vector<Point> chunk;
+
+            for (size_t done = 0; done < count; done += chunk.size()) {
+                chunk.resize(std::min(chunk_size, count - done));
+                if (!in.read(reinterpret_cast<char*>(chunk.data()), std::streamsize(chunk.size() * sizeof(Point)))) {
+                    throw std::runtime_error("kdtree: cannot read " + file.string());
+                }
+                fn(std::span<const Point>(chunk));
+            }
+        }
+
+        // Buffered appends to a point file.
+        template<class Point>
+        class point_writer {
+        public:
+            point_writer(const std::filesystem::path& file, const size_t buffer_size)
+                : out_(file, std::ios::binary | std::ios::trunc)
+                , file_(file)
+                , buffer_size_(std::max<size_t>(buffer_size, 1)) {
+                if (!out_) {
+                    throw std::runtime_error("kdtree: cannot open " + file.string() + " for writing");
+                }
+                buffer_.reserve(buffer_size_);
+            }
+
+            void push(const Point& p) {
+                buffer_.push_back(p);
+                ++count_;
+                if (buffer_.size() == buffer_size_) {
+                    flush();
+                }
+            }
+
+            size_t count() const {
+                return count_;
+            }
+
+            void close() {
+                flush();
+                out_.close();
+                if (!out_) {
+                    throw std::runtime_error("kdtree: cannot write " + file_.string());
+                }
+            }
+
+        private:
+            void flush() {
+                out_.write(reinterpret_cast<const char*>(buffer_.data()), std::streamsize(buffer_.size() * sizeof(Point)));
+                buffer_.clear();
+            }
+
+            std::ofstream out_;
+            std::filesystem::path file_;
+            size_t buffer_size_;
+            std::vector<Point> buffer_;
+            size_t count_ = 0;
+        };
+    }
+
+    // Builds the tree file of the points in points_path, a raw array of
+    // Point as laid out in memory, for point sets larger than memory. Point
+    // ranges that do not fit external.memory_budget are split on disk: one
+    // pass finds the extent of the range and a uniform sample of it, the
+    // splitting point is chosen from the sample by options.split, and a
+    // second pass partitions the range into two temporary files. Ranges
+    // that fit are built in memory with options and written straight to
+    // their place in the file. Open the result with mapped_tree.
+    // Throws std::runtime_error on I/O errors.
+    template<mappable_point Point>
+    void build_tree_file(
+        const std::filesystem::path& points_path,
+        const std::filesystem::path& tree_path,
+        const int kdim,
+        const build_options& options = {},
+        const external_build_options& external = {}) {
+
+        using distance_t = point_distance_t<Point>;
+
+        const auto dim = int(detail::make_kdim<Point>(kdim));
+        const auto input_size = std::filesystem::file_size(points_path);
+        if (input_size % sizeof(Point) != 0) {
+            throw std::runtime_error("kdtree: size of " + points_path.string() + " is not a multiple of the point size");
+        }
+
+        const auto length = size_t(input_size / sizeof(Point));
+        const auto leaf_size = std::max<size_t>(options.leaf_size, 1);
+        const auto soa = options.layout == coordinate_layout::soa && length > 0;
+
+        constexpr auto lanes = coordinate_storage<distance_t>::lanes;
+        const auto coords_stride = soa ? (length + lanes - 1) / lanes * lanes : 0;
+        const auto coords_size = soa ? coords_stride * size_t(dim) + lanes : 0;
+
+        const auto header = detail::make_tree_file_header<Point>(length, dim, leaf_size, coords_stride, coords_size, false);
+
+        {
+            std::ofstream create(tree_path, std::ios::binary | std::ios::trunc);
+            if (!create.write(reinterpret_cast<const char*>(&header), sizeof(header))) {
+                throw std::runtime_error("kdtree: cannot write " + tree_path.string());
+            }
+        }
+        std::filesystem::resize_file(tree_path, detail::tree_file_size(header));
+
+        std::fstream out(tree_path, std::ios::binary | std::ios::in | std::ios::out);
+        const auto write_at = [&out](const std::uint64_t offset, const void* data, const size_t bytes) {
+            out.seekp(std::streamoff(offset));
+            out.write(static_cast<const char*>(data), std::streamsize(bytes));
+        };
+
+        // writes a subtree built on its own, with nodes relative to its
+        // root, at record first
+        const auto write_subtree = [&](const size_t first, const std::span<const Point> points, std::span<flat_node> nodes) {
+            for (auto& node : nodes) {
+                node.right += first;
+            }
+            write_at(header.points + first * sizeof(Point), points.data(), points.size_bytes());
+            write_at(header.nodes + first * sizeof(flat_node), nodes.data(), nodes.size_bytes());
+
+            if (soa) {
+                std::vector<distance_t> values(points.size());
+                for (size_t axis = 0; axis < size_t(dim); ++axis) {
+                    std::ranges::transform(points, values.begin(), [axis](const Point& p) { return distance_t(p[axis]); });
+                    write_at(header.coords + (axis * coords_stride + first) * sizeof(distance_t), values.data(), values.size() * sizeof(distance_t));
+                }
+            }
+        };
+
+        const auto budget = std::max<size_t>(external.memory_budget, 1);
+        const auto fit = std::max<size_t>(budget / (2 * sizeof(Point) + sizeof(flat_node)), leaf_size);
+        const auto chunk_size = std::max<size_t>(budget / (4 * sizeof(Point)), 1);
+
+        auto in_memory = options;
+        in_memory.layout = coordinate_layout::aos;
+
+        struct pending_range {
+            std::filesystem::path file;
+            bool temporary;
+            size_t count;
+            size_t out;
+            size_t axis;
+        };
+
+        detail::scratch_files scratch(external.temp_directory);
+        std::vector<pending_range> stack{ { points_path, false, length, 0, 0 } };
+
+        while (!stack.empty()) {
+            const auto range = stack.back();
+            stack.pop_back();
+
+            if (range.count == 0) {
+                continue;
+            }
+
+            if (range.count <= fit) {
+                std::vector<Point> points;
+                detail::for_each_chunk<Point>(range.file, range.count, range.count, [&points](const auto chunk) {
+                    points.assign(chunk.begin(), chunk.end());
+                });
+                if (range.temporary) {
+                    scratch.remove(range.file);
+                }
+
+                auto storage = detail::build(std::move(points), dim, in_memory);
+                write_subtree(range.out, storage.points, storage.nodes);
+                continue;
+            }
+
+            // extent and a uniform sample of the range
+            std::vector<distance_t> lo(dim), hi(dim);
+            std::vector<Point> sample;
+            const auto sample_size = std::clamp<size_t>(external.sample_size, 1, range.count);
+            sample.reserve(sample_size);
+
+            std::default_random_engine rng(std::default_random_engine::result_type(range.out + range.count));
+            size_t seen = 0;
+
+            detail::for_each_chunk<Point>(range.file, range.count, chunk_size, [&](const auto chunk) {
+                for (const auto& p : chunk) {
+                    for (size_t axis = 0; axis < size_t(dim); ++axis) {
+                        const auto c = distance_t(p[axis]);
+                        if (seen == 0 || c < lo[axis]) lo[axis] = c;
+                        if (seen == 0 || hi[axis] < c) hi[axis] = c;
+                    }
+
+                    if (sample.size() < sample_size) {
+                        sample.push_back(p);
+                    }
+                    else if (const auto j = std::uniform_int_distribution<size_t>(0, seen)(rng); j < sample_size) {
+                        sample[j] = p;
+                    }
+                    ++seen;
+                }
+            });
+
+            auto axis = range.axis;
+            if (options.split != split_rule::round_robin) {
+                axis = 0;
+                for (size_t a = 1; a < size_t(dim); ++a) {
+                    if (hi[a] - lo[a] > hi[axis] - lo[axis]) {
+                        axis = a;
+                    }
+                }
+            }
+
+            const auto by_axis = [axis](const Point& a, const Point& b) { return a[axis] < b[axis]; };
+            std::ranges::nth_element(sample, sample.begin() + sample.size() / 2, by_axis);
+            auto pivot = sample[sample.size() / 2];
+
+            if (options.split == split_rule::sliding_midpoint && lo[axis] < hi[axis]) {
+                // the sampled point nearest past the middle of the extent
+                const auto cut = lo[axis] + (hi[axis] - lo[axis]) / 2;
+                const Point* past = nullptr;
+                for (const auto& p : sample) {
+                    if (!(p[axis] < cut) && (!past || p[axis] < (*past)[axis])) {
+                        past = &p;
+                    }
+                }
+                pivot = past ? *past : *std::ranges::max_element(sample, by_axis);
+            }
+
+            // partition around the pivot, points level with it go to either
+            // side in turn
+            const auto left_file = scratch.make();
+            const auto right_file = scratch.make();
+            detail::point_writer<Point> left(left_file, chunk_size);
+            detail::point_writer<Point> right(right_file, chunk_size);
+
+            const auto value = pivot[axis];
+            auto pivot_found = false;
+            auto tie_left = true;
+
+            detail::for_each_chunk<Point>(range.file, range.count, chunk_size, [&](const auto chunk) {
+                for (const auto& p : chunk) {
+                    if (!pivot_found && std::memcmp(&p, &pivot, sizeof(Point)) == 0) {
+                        pivot_found = true;
+                    }
+                    else if (p[axis] < value) {
+                        left.push(p);
+                    }
+                    else if (value < p[axis]) {
+                        right.push(p);
+                    }
+                    else {
+                        (tie_left ? left : right).push(p);
+                        tie_left = !tie_left;
+                    }
+                }
+            });
+
+            left.close();
+            right.close();
+            if (range.temporary) {
+                scratch.remove(range.file);
+            }
+
+            flat_node node{ 1 + left.count(), std::uint32_t(axis) };
+            write_subtree(range.out, std::span<const Point>(&pivot, 1), std::span<flat_node>(&node, 1));
+
+            const auto axis_next = detail::next_axis(axis, dim);
+            stack.push_back({ right_file, true, right.count(), range.out + 1 + left.count(), axis_next });
+            stack.push_back({ left_file, true, left.count(), range.out + 1, axis_next });
+        }
+
+        if (!out.flush()) {
+            throw std::runtime_error("kdtree: cannot write " + tree_path.string());
+        }
+    }
+}
@@ -0,0 +1,154 @@
+#pragma once
+
+#include "tree.hpp"
+#include "point_traits.hpp"
+
+#include <cstddef>
+#include <span>
+#include <vector>
+
+namespace kdtree {
+
+    // Reference to a point in storage owned by someone else. Behaves like
+    // the point it refers to, so a tree of references splits and searches
+    // exactly like a tree of the points themselves.
+    template<point Point>
+    struct point_ref {
+        const Point* value = nullptr;
+
+        decltype(auto) operator[](size_t axis) const {
+            return (*value)[axis];
+        }
+    };
+
+    template<point Point>
+    struct point_distance<point_ref<Point>> {
+        using type = point_distance_t<Point>;
+    };
+
+    template<static_kdim_point Point>
+    struct point_kdim<point_ref<Point>> {
+        static constexpr auto value = point_kdim_v<Point>;
+    };
+
+    template<point Point>
+    struct point_traits<point_ref<Point>> {
+        static constexpr std::string format(const point_ref<Point>& p) {
+            return format_point(*p.value);
+        }
+    };
+
+    // Tree over points owned by the caller, which must outlive it and stay
+    // where they are. Nothing is copied at build time, and queries answer
+    // with positions in the caller's storage, so results can be joined
+    // against other arrays of the same order.
+    template<point Point>
+    class index_tree {
+    public:
+
+        using point_type = Point;
+        using distance_type = point_distance_t<Point>;
+        using neighbor_type = neighbor<size_t, distance_type>;
+
+        // returned by find_nearest for an empty tree
+        static constexpr size_t npos = ~size_t(0);
+
+        index_tree() = default;
+
+        static index_tree build(std::span<const Point> points, int kdim, const build_options& options = {}) {
+            std::vector<point_ref<Point>> refs(points.size());
+            for (size_t i = 0; i < points.size(); ++i) {
+                refs[i].value = &points[i];
+            }
+            return index_tree(points, tree<point_ref<Point>>::build(std::move(refs), kdim, options));
+        }
+
+        std::span<const Point> points() const {
+            return points_;
+        }
+
+        const tree<point_ref<Point>>& refs() const {
+            return tree_;
+        }
+
+        int kdim() const {
+            return tree_.kdim();
+        }
+
+        constexpr bool is_empty() const {
+            return tree_.is_empty();
+        }
+
+        size_t find_nearest(const Point& key, const double eps = 0) const {
+            return index_of(tree_.find_nearest(make_ref(key), eps));
+        }
+
+        std::vector<size_t> find_nearest_n(const Point& key, const auto& num, const double eps = 0) const {
+            const auto refs{ tree_.find_nearest_n(make_ref(key), num, eps) };
+            std::vector<size_t> indices(refs.size());
+            std::ranges::transform(refs, indices.begin(), [this](const auto& ref) { return index_of(ref); });
+            return indices;
+        }
+
+        // npos and std::numeric_limits<distance_type>::max() for an empty tree
+        neighbor_type find_nearest_neighbor(const Point& key, const double eps = 0) const {
+            const auto [ref, dist] = tree_.find_nearest_neighbor(make_ref(key), eps);
+            return { index_of(ref), dist };
+        }
+
+        // See tree::find_nearest_neighbors.
+        size_t find_nearest_neighbors(const Point& key, std::span<neighbor_type> out, const double eps = 0) const {
+            const auto& results = detail::find_nearest_n(
+                tree_.storage(), make_ref(key), kdim_ref(), out.size(), tree_.leaf_size(), eps,
+                detail::thread_result_heap<point_ref<Point>>());
+            std::ranges::transform(results, out.begin(), [this](const auto& res) {
+                return neighbor_type{ index_of(tree_.storage().points[res.first]), res.second };
+            });
+            return results.size();
+        }
+
+        template<class Visitor>
+        requires std::invocable<Visitor&, size_t>
+        void visit_within_radius(const Point& key, const distance_type& radius, Visitor&& visitor) const {
+            tree_.visit_within_radius(make_ref(key), radius,
+                [this, &visitor](const point_ref<Point>& ref) { visitor(index_of(ref)); });
+        }
+
+        std::vector<size_t> find_within_radius(const Point& key, const distance_type& radius) const {
+            std::vector<size_t> out;
+            visit_within_radius(key, radius, [&out](size_t index) { out.push_back(index); });
+            return out;
+        }
+
+        size_t count_within_radius(const Point& key, const distance_type& radius) const {
+            return tree_.count_within_radius(make_ref(key), radius);
+        }
+
+    private:
+        index_tree(std::span<const Point> points, tree<point_ref<Point>> refs)
+            : points_(points)
+            , tree_(std::move(refs)) {}
+
+        static point_ref<Point> make_ref(const Point& key) {
+            return { &key };
+        }
+
+        auto kdim_ref() const {
+            return detail::make_kdim<point_ref<Point>>(tree_.kdim());
+        }
+
+        size_t index_of(const point_ref<Point>& ref) const {
+            return ref.value ? size_t(ref.value - points_.data()) : npos;
+        }
+
+        std::span<const Point> points_;
+        tree<point_ref<Point>> tree_;
+    };
+
+    template<std::ranges::contiguous_range Points>
+    requires points_range<Points>
+    index_tree<points_range_point_t<Points>> build_index_tree(const Points& points, const build_options& options = {}) {
+        using point_t = points_range_point_t<Points>;
+        return index_tree<point_t>::build(points, point_kdim_v<point_t>, options);
+    }
+}
@@ -0,0 +1,457 @@
+#pragma once
+
+#include "tree.hpp"
+#include "tree_detail.hpp"
+#include "node_storage.hpp"
+#include "point_traits.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <new>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define KDTREE_HAS_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace kdtree {
+
+    // Points that can be written to a tree file byte by byte.
+    template<class Point>
+    concept mappable_point =
+        point<Point> &&
+        std::is_trivially_copyable_v<Point> &&
+        std::is_arithmetic_v<point_distance_t<Point>>;
+
+    inline constexpr std::uint32_t tree_file_version = 1;
+
+    // Tree file layout: this header, then the arrays of node_storage, each
+    // at a 64-byte aligned offset from the start of the file. Offsets are
+    // 0 for arrays the tree does not have. The file is written in the byte
+    // order and with the point layout of the machine that writes it, and
+    // the header records enough of both to refuse a file written elsewhere.
+    struct tree_file_header {
+        char magic[8];
+        std::uint32_t version;
+        std::uint32_t byte_order;  // tree_file_byte_order as written
+        std::uint32_t point_size;
+        std::uint32_t distance_size;
+        std::uint32_t distance_is_float;
+        std::uint32_t node_size;
+        std::uint64_t kdim;
+        std::uint64_t size;  // number of records
+        std::uint64_t leaf_size;
+        std::uint64_t coords_stride;
+        std::uint64_t coords_size;  // number of values
+        std::uint64_t points;
+        std::uint64_t nodes;
+        std::uint64_t coords;
+        std::uint64_t dead;
+        std::uint64_t live;
+    };
+
+    inline constexpr char tree_file_magic[8] = { 'k', 'd', 't', 'r', 'e', 'e', 0, 0 };
+    inline constexpr std::uint32_t tree_file_byte_order = 0x01020304;
+
+    namespace detail {
+        inline constexpr size_t tree_file_alignment = 64;
+
+        inline std::uint64_t align_file_offset(const std::uint64_t offset) {
+            return (offset + tree_file_alignment - 1) / tree_file_alignment * tree_file_alignment;
+        }
+
+        // Header of a tree of size records, with the arrays laid out in the
+        // order of the fields.
+        template<mappable_point Point>
+        tree_file_header make_tree_file_header(
+            const size_t size,
+            const int kdim,
+            const size_t leaf_size,
+            const size_t coords_stride,
+            const size_t coords_size,
+            const bool erased) {
+
+            using distance_t = point_distance_t<Point>;
+
+            tree_file_header header{};
+            std::memcpy(header.magic, tree_file_magic, sizeof(header.magic));
+            header.version = tree_file_version;
+            header.byte_order = tree_file_byte_order;
+            header.point_size = sizeof(Point);
+            header.distance_size = sizeof(distance_t);
+            header.distance_is_float = std::is_floating_point_v<distance_t>;
+            header.node_size = sizeof(flat_node);
+            header.kdim = std::uint64_t(kdim);
+            header.size = size;
+            header.leaf_size = leaf_size;
+            header.coords_stride = coords_stride;
+            header.coords_size = coords_size;
+
+            auto offset = align_file_offset(sizeof(tree_file_header));
+            const auto place = [&offset](std::uint64_t& field, const size_t bytes) {
+                if (bytes > 0) {
+                    field = offset;
+                    offset = align_file_offset(offset + bytes);
+                }
+            };
+
+            place(header.points, size * sizeof(Point));
+            place(header.nodes, size * sizeof(flat_node));
+            place(header.coords, coords_size * sizeof(distance_t));
+            place(header.dead, erased ? size : 0);
+            place(header.live, erased ? size * sizeof(size_t) : 0);
+
+            return header;
+        }
+
+        // total size of a file with this header
+        inline std::uint64_t tree_file_size(const tree_file_header& header) {
+            const auto end = [](const std::uint64_t offset, const std::uint64_t bytes) {
+                return offset ? offset + bytes : 0;
+            };
+            return std::max({
+                std::uint64_t(sizeof(tree_file_header)),
+                end(header.points, header.size * header.point_size),
+                end(header.nodes, header.size * header.node_size),
+                end(header.coords, header.coords_size * header.distance_size),
+                end(header.dead, header.size),
+                end(header.live, header.size * sizeof(size_t)),
+            });
+        }
+
+        // Checks that a file of file_size bytes starting with header can be
+        // viewed as a tree of Point, and throws std::runtime_error if not:
+        // every array lies within the file, and the coordinate arrays are
+        // padded for the whole-vector loads of the searches. The node
+        // records and points themselves are not read, opening stays O(1),
+        // so tree files are trusted input: a file with valid header but
+        // corrupt nodes can still make searches read out of bounds.
+        template<mappable_point Point>
+        void check_tree_file_header(const tree_file_header& header, const size_t file_size) {
+            using distance_t = point_distance_t<Point>;
+            constexpr auto lanes = coordinate_storage<distance_t>::lanes;
+
+            const auto fail = [](const char* what) {
+                throw std::runtime_error(std::string("kdtree: invalid tree file, ") + what);
+            };
+
+            if (std::memcmp(header.magic, tree_file_magic, sizeof(header.magic)) != 0) fail("bad magic");
+            if (header.version != tree_file_version) fail("unsupported version");
+            if (header.byte_order != tree_file_byte_order) fail("different byte order");
+            if (header.point_size != sizeof(Point) ||
+                header.distance_size != sizeof(distance_t) ||
+                header.distance_is_float != std::is_floating_point_v<distance_t> ||
+                header.node_size != sizeof(flat_node)) fail("different point type");
+            if ((header.kdim == 0 && header.size > 0) || header.kdim > std::uint64_t(std::numeric_limits<int>::max())) fail("bad kdim");
+            if constexpr (static_kdim_point<Point>) {
+                if (header.kdim != 0 && header.kdim != point_kdim_v<Point>) fail("different kdim");
+            }
+
+            // bytes of count elements, refusing counts that cannot fit the
+            // file before they can overflow
+            const auto bytes = [&](const std::uint64_t count, const size_t element_size) {
+                if (count > file_size / element_size) fail("array out of bounds");
+                return count * element_size;
+            };
+
+            const auto check = [&](const std::uint64_t offset, const std::uint64_t bytes, const bool required) {
+                if (bytes == 0) {
+                    return;
+                }
+                if (offset == 0) {
+                    if (required) fail("missing array");
+                    return;
+                }
+                if (offset % tree_file_alignment != 0 || offset > file_size || bytes > file_size - offset) {
+                    fail("array out of bounds");
+                }
+            };
+
+            check(header.points, bytes(header.size, sizeof(Point)), true);
+            check(header.nodes, bytes(header.size, sizeof(flat_node)), true);
+            check(header.coords, bytes(header.coords_size, sizeof(distance_t)), false);
+            check(header.dead, header.dead ? bytes(header.size, 1) : 0, false);
+            check(header.live, header.live ? bytes(header.size, sizeof(size_t)) : 0, false);
+
+            if (header.coords && header.coords_size > 0) {
+                // the padding of make_coordinates: stride rounded up to
+                // whole vectors, one more vector past the last axis, i.e.
+                // coords_size >= coords_stride * kdim + lanes without the
+                // product overflowing
+                const auto min_stride = (header.size + lanes - 1) / lanes * lanes;
+                if (header.coords_size < lanes ||
+                    header.coords_stride < min_stride ||
+                    (header.kdim > 0 && header.coords_stride > (header.coords_size - lanes) / header.kdim)) fail("bad coordinates");
+            }
+            if (bool(header.dead) != bool(header.live)) fail("bad erase arrays");
+        }
+    }
+
+    // Writes the tree to a file that mapped_tree can open. Throws
+    // std::runtime_error if the file cannot be written.
+    template<mappable_point Point>
+    void save_tree(const tree<Point>& tree, const std::filesystem::path& path) {
+        const auto& storage = tree.storage();
+        const auto header = detail::make_tree_file_header<Point>(
+            storage.nodes.size(), tree.kdim(), tree.leaf_size(),
+            storage.coords.stride, storage.coords.values.size(), !storage.dead.empty());
+
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        if (!out) {
+            throw std::runtime_error("kdtree: cannot open " + path.string() + " for writing");
+        }
+
+        std::uint64_t written = 0;
+        const auto write = [&out, &written](const std::uint64_t offset, const void* data, const size_t bytes) {
+            if (bytes == 0) {
+                return;
+            }
+            static constexpr char zeros[detail::tree_file_alignment] = {};
+            out.write(zeros, std::streamsize(offset - written));
+            out.write(static_cast<const char*>(data), std::streamsize(bytes));
+            written = offset + bytes;
+        };
+
+        write(0, &header, sizeof(header));
+        write(header.points, storage.points.data(), storage.points.size() * sizeof(Point));
+        write(header.nodes, storage.nodes.data(), storage.nodes.size() * sizeof(flat_node));
+        write(header.coords, storage.coords.values.data(), storage.coords.values.size() * sizeof(point_distance_t<Point>));
+        write(header.dead, storage.dead.data(), storage.dead.size());
+        write(header.live, storage.live.data(), storage.live.size() * sizeof(size_t));
+
+        if (!out.flush()) {
+            throw std::runtime_error("kdtree: cannot write " + path.string());
+        }
+    }
+
+    // Tree searched in place in a file written by save_tree. Opening maps
+    // the file read-only and checks its header, nothing is parsed or
+    // copied, so processes that open the same file share its pages. On
+    // systems without mmap the file is read into one aligned buffer.
+    template<mappable_point Point>
+    class mapped_tree {
+    public:
+
+        using point_type = Point;
+        using distance_type = point_distance_t<Point>;
+        using neighbor_type = neighbor<Point, distance_type>;
+
+        mapped_tree()
+            : kdim_(detail::make_kdim<Point>(0)) {}
+
+        // Throws std::runtime_error if the file cannot be read or does not
+        // hold a tree of Point.
+        explicit mapped_tree(const std::filesystem::path& path)
+            : kdim_(detail::make_kdim<Point>(0)) {
+            map(path);
+
+            tree_file_header header;
+            if (size_ < sizeof(header)) {
+                unmap();
+                throw std::runtime_error("kdtree: invalid tree file, too short");
+            }
+            std::memcpy(&header, data_, sizeof(header));
+
+            try {
+                detail::check_tree_file_header<Point>(header, size_);
+            }
+            catch (...) {
+                unmap();
+                throw;
+            }
+
+            storage_.points = array<Point>(header.points, header.size);
+            storage_.nodes = array<flat_node>(header.nodes, header.size);
+            storage_.coords = { array<distance_type>(header.coords, header.coords_size), size_t(header.coords_stride) };
+            storage_.dead = array<std::uint8_t>(header.dead, header.size);
+            storage_.live = array<size_t>(header.live, header.size);
+
+            kdim_ = detail::make_kdim<Point>(int(header.kdim));
+            leaf_size_ = std::max<size_t>(header.leaf_size, 1);
+        }
+
+        mapped_tree(const mapped_tree&) = delete;
+        mapped_tree& operator=(const mapped_tree&) = delete;
+
+        mapped_tree(mapped_tree&& other)
+            : kdim_(detail::make_kdim<Point>(0)) {
+            swap(other);
+        }
+
+        mapped_tree& operator=(mapped_tree&& other) {
+            swap(other);
+            return *this;
+        }
+
+        ~mapped_tree() {
+            unmap();
+        }
+
+        const node_storage_view<Point>& storage() const {
+            return storage_;
+        }
+
+        size_t leaf_size() const {
+            return leaf_size_;
+        }
+
+        int kdim() const {
+            return int(kdim_);
+        }
+
+        size_t size() const {
+            return detail::live_size(storage_);
+        }
+
+        bool is_empty() const {
+            return size() == 0;
+        }
+
+        // See tree::stats, the byte counts are of the mapped arrays.
+        tree_stats stats() const {
+            return detail::make_tree_stats(storage_, size_t(kdim()), leaf_size_);
+        }
+
+        Point find_nearest(const Point& key, const double eps = 0) const {
+            return detail::find_nearest(storage_, key, kdim_, leaf_size_, eps);
+        }
+
+        std::vector<Point> find_nearest_n(const Point& key, const auto& num, const double eps = 0) const {
+            return detail::find_nearest_n(storage_, key, kdim_, num, leaf_size_, eps);
+        }
+
+        // See tree::find_nearest_neighbor.
+        neighbor_type find_nearest_neighbor(const Point& key, const double eps = 0) const {
+            const auto [index, dist] = detail::find_nearest_result(storage_, key, kdim_, leaf_size_, eps);
+            return { is_empty() ? Point{} : storage_.points[index], dist };
+        }
+
+        // See tree::find_nearest_neighbors.
+        size_t find_nearest_neighbors(const Point& key, std::span<neighbor_type> out, const double eps = 0) const {
+            const auto& results = detail::find_nearest_n(
+                storage_, key, kdim_, out.size(), leaf_size_, eps, detail::thread_result_heap<Point>());
+            std::ranges::transform(results, out.begin(),
+                [this](const auto& res) { return neighbor_type{ storage_.points[res.first], res.second }; });
+            return results.size();
+        }
+
+        template<class Visitor>
+        requires std::invocable<Visitor&, const Point&>
+        void visit_within_radius(const Point& key, const distance_type& radius, Visitor&& visitor) const {
+            detail::visit_within_radius(storage_, key, kdim_, radius_sqr(radius), leaf_size_,
+                [this, &visitor](size_t index, const distance_type&) { visitor(storage_.points[index]); });
+        }
+
+        std::vector<Point> find_within_radius(const Point& key, const distance_type& radius) const {
+            std::vector<Point> out;
+            visit_within_radius(key, radius, [&out](const Point& p) { out.push_back(p); });
+            return out;
+        }
+
+        size_t count_within_radius(const Point& key, const distance_type& radius) const {
+            size_t count = 0;
+            detail::visit_within_radius(storage_, key, kdim_, radius_sqr(radius), leaf_size_,
+                [&count](size_t, const distance_type&) { ++count; });
+            return count;
+        }
+
+    private:
+        static distance_type radius_sqr(const distance_type& radius) {
+            return radius < 0 ? distance_type(-1) : radius * radius;
+        }
+
+        template<class T>
+        std::span<const T> array(const std::uint64_t offset, const std::uint64_t count) const {
+            return offset == 0
+                ? std::span<const T>()
+                : std::span<const T>(reinterpret_cast<const T*>(data_ + offset), size_t(count));
+        }
+
+        void swap(mapped_tree& other) {
+            std::swap(data_, other.data_);
+            std::swap(size_, other.size_);
+            std::swap(storage_, other.storage_);
+            std::swap(kdim_, other.kdim_);
+            std::swap(leaf_size_, other.leaf_size_);
+        }
+
+#ifdef KDTREE_HAS_MMAP
+        void map(const std::filesystem::path& path) {
+            const auto fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                throw std::runtime_error("kdtree: cannot open " + path.string());
+            }
+
+            struct stat st;
+            if (::fstat(fd, &st) != 0) {
+                ::close(fd);
+                throw std::runtime_error("kdtree: cannot stat " + path.string());
+            }
+
+            size_ = size_t(st.st_size);
+            if (size_ > 0) {
+                void* data = ::mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+                if (data == MAP_FAILED) {
+                    ::close(fd);
+                    throw std::runtime_error("kdtree: cannot map " + path.string());
+                }
+                data_ = static_cast<const std::byte*>(data);
+            }
+
+            ::close(fd);
+        }
+
+        void unmap() {
+            if (data_) {
+                ::munmap(const_cast<std::byte*>(data_), size_);
+            }
+            data_ = nullptr;
+            size_ = 0;
+        }
+#else
+        void map(const std::filesystem::path& path) {
+            std::ifstream in(path, std::ios::binary | std::ios::ate);
+            if (!in) {
+                throw std::runtime_error("kdtree: cannot open " + path.string());
+            }
+
+            size_ = size_t(in.tellg());
+            auto* data = static_cast<std::byte*>(::operator new(size_, std::align_val_t(detail::tree_file_alignment)));
+            in.seekg(0);
+            if (!in.read(reinterpret_cast<char*>(data), std::streamsize(size_))) {
+                ::operator delete(data, std::align_val_t(detail::tree_file_alignment));
+                throw std::runtime_error("kdtree: cannot read " + path.string());
+            }
+            data_ = data;
+        }
+
+        void unmap() {
+            if (data_) {
+                ::operator delete(const_cast<std::byte*>(data_), std::align_val_t(detail::tree_file_alignment));
+            }
+            data_ = nullptr;
+            size_ = 0;
+        }
+#endif
+
+        const std::byte* data_ = nullptr;
+        size_t size_ = 0;
+        node_storage_view<Point> storage_;
+        [[no_unique_address]] detail::kdim_type_t<Point> kdim_;
+        size_t leaf_size_ = 1;
+    };
+}
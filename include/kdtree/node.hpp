@@ -2,15 +2,46 @@
 
 #include "point_traits.hpp"
 #include <memory>
+#include <memory_resource>
+#include <new>
 #include <ostream>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 namespace kdtree {
+    template<class Point>
+    class node;
+
+    // Deleter of node_container_t. Nodes from make_node are deleted with
+    // operator delete, nodes from allocate_node are returned to their
+    // memory resource. Nodes from a node_arena are freed with the arena, so
+    // for trivially destructible points dropping them does nothing at all,
+    // not even a walk over the children.
+    template<class Point>
+    struct node_deleter {
+        std::pmr::memory_resource* resource = nullptr;  // nullptr for operator new
+        bool arena = false;
+
+        void operator()(node<Point>* value) const {
+            if (arena && std::is_trivially_destructible_v<Point>) {
+                return;
+            }
+            if (!resource) {
+                delete value;
+                return;
+            }
+            value->~node();
+            resource->deallocate(value, sizeof(node<Point>), alignof(node<Point>));
+        }
+    };
+
     template<class Point>
     class node
     {
     public:
         using point_type = Point;
-        using container_type = std::unique_ptr<node>;
+        using container_type = std::unique_ptr<node, node_deleter<Point>>;
 
         node() : value_({}) {}
             
@@ -21,6 +52,21 @@ namespace kdtree {
         node(const Point& value) : value_(value) {
         }
 
+        node(node&&) = default;
+        node& operator=(node&&) = default;
+
+        // Children are released one by one, so that destroying a deep
+        // hand-made tree does not recurse once per level.
+        ~node() {
+            std::vector<container_type> pending;
+            release_children(pending);
+            while (!pending.empty()) {
+                auto child = std::move(pending.back());
+                pending.pop_back();
+                child->release_children(pending);
+            }
+        }
+
         const Point& value() const {
             return value_;
         }
@@ -47,6 +93,11 @@ namespace kdtree {
 
     private:
 
+        void release_children(std::vector<container_type>& pending) {
+            if (left_) pending.push_back(std::move(left_));
+            if (right_) pending.push_back(std::move(right_));
+        }
+
         Point value_;
         container_type left_;
         container_type right_;
@@ -57,13 +108,20 @@ namespace kdtree {
         
     template<typename Point>
     bool operator==(const node<Point>& a, const node<Point>& b) {
-        if (a.value() != b.value()) return false;
-        
-        if (bool(a.left()) != bool(b.left())) return false;
-        if (bool(a.left()) && *a.left() != *b.left()) return false;
-        
-        if (bool(a.right()) != bool(b.right())) return false;
-        if (bool(a.right()) && *a.right() != *b.right()) return false;
+        std::vector<std::pair<const node<Point>*, const node<Point>*>> pending{ { &a, &b } };
+
+        while (!pending.empty()) {
+            const auto [x, y] = pending.back();
+            pending.pop_back();
+
+            if (x->value() != y->value()) return false;
+
+            if (bool(x->left()) != bool(y->left())) return false;
+            if (bool(x->left())) pending.emplace_back(x->left().get(), y->left().get());
+
+            if (bool(x->right()) != bool(y->right())) return false;
+            if (bool(x->right())) pending.emplace_back(x->right().get(), y->right().get());
+        }
 
         return true;
     }
@@ -75,17 +133,68 @@ namespace kdtree {
 
     template<class Point>
     static constexpr node<Point>::container_type make_leaf() {
-        return std::unique_ptr<node<Point>>();
+        return typename node<Point>::container_type();
     }
 
     template<class Point, class... Args>
     static constexpr node<Point>::container_type make_node(Point value, Args&&... args) {
-        return std::make_unique<node<Point>>(std::forward<Point>(value), std::forward<Args>(args)...);
+        return typename node<Point>::container_type(new node<Point>(std::forward<Point>(value), std::forward<Args>(args)...));
+    }
+
+    // Like make_node, with the node allocated from resource, which must
+    // outlive it.
+    template<class Point, class... Args>
+    node<Point>::container_type allocate_node(std::pmr::memory_resource& resource, Point value, Args&&... args) {
+        void* memory = resource.allocate(sizeof(node<Point>), alignof(node<Point>));
+        try {
+            return typename node<Point>::container_type(
+                new (memory) node<Point>(std::move(value), std::forward<Args>(args)...), { &resource, false });
+        }
+        catch (...) {
+            resource.deallocate(memory, sizeof(node<Point>), alignof(node<Point>));
+            throw;
+        }
     }
 
     template<class Point>
     using node_container_t = node<Point>::container_type;
 
+    // Monotonic arena for hand-made trees. Nodes are carved out of a few
+    // large blocks and freed all at once when the arena is destroyed or
+    // released, rather than one by one, which suits many short-lived trees.
+    // Children of arena nodes must come from the same arena, and trees of
+    // points that are not trivially destructible must be dropped before
+    // the arena is.
+    template<class Point>
+    class node_arena {
+    public:
+        explicit node_arena(std::pmr::memory_resource* upstream = std::pmr::get_default_resource())
+            : resource_(upstream) {}
+
+        // Reserves room for about count nodes up front.
+        node_arena(const size_t count, std::pmr::memory_resource* upstream = std::pmr::get_default_resource())
+            : resource_(count * sizeof(node<Point>), upstream) {}
+
+        node_arena(const node_arena&) = delete;
+        node_arena& operator=(const node_arena&) = delete;
+
+        template<class... Args>
+        node_container_t<Point> make_node(Point value, Args&&... args) {
+            auto result = allocate_node(resource_, std::move(value), std::forward<Args>(args)...);
+            result.get_deleter().arena = true;
+            return result;
+        }
+
+        // Frees the memory of all nodes made so far, which must not be used
+        // afterwards.
+        void release() {
+            resource_.release();
+        }
+
+    private:
+        std::pmr::monotonic_buffer_resource resource_;
+    };
+
     namespace detail {
         inline void indent(std::ostream& os, const int& level) {
             for (auto i = 0; i < level; ++i) {
@@ -93,19 +202,42 @@ namespace kdtree {
             }
         }
 
-        template<class Point>
-        void format(std::ostream& os, const node<Point>& node, const int& level = 0) {
+        // Prints the tree in pre-order with an explicit stack. Node is either
+        // node<Point>, which is referred to by pointer, or a copyable handle
+        // such as node_view, which is kept by value.
+        template<class Node>
+        void format(std::ostream& os, const Node& root, const int& level = 0) {
 
-            indent(os, level);
+            using point_t = typename Node::point_type;
+            using handle_t = std::conditional_t<std::is_copy_constructible_v<Node>, Node, const Node*>;
 
-            os << point_traits<Point>::format(node.value()) << "\n";
+            const auto make_handle = [](const Node& node) -> handle_t {
+                if constexpr (std::is_pointer_v<handle_t>) return &node;
+                else return node;
+            };
 
-            if (bool(node.left())) {
-                format(os, *node.left(), level + 1);
-            }
+            std::vector<std::pair<handle_t, int>> pending{ { make_handle(root), level } };
+
+            while (!pending.empty()) {
+                const auto [handle, node_level] = pending.back();
+                pending.pop_back();
+
+                const Node& node = [&handle]() -> const Node& {
+                    if constexpr (std::is_pointer_v<handle_t>) return *handle;
+                    else return handle;
+                }();
+
+                indent(os, node_level);
+
+                os << point_traits<point_t>::format(node.value()) << "\n";
+
+                if (bool(node.right())) {
+                    pending.emplace_back(make_handle(*node.right()), node_level + 1);
+                }
 
-            if (bool(node.right())) {
-                format(os, *node.right(), level + 1);
+                if (bool(node.left())) {
+                    pending.emplace_back(make_handle(*node.left()), node_level + 1);
+                }
             }
         }
     }
@@ -0,0 +1,376 @@
+#pragma once
+
+#include "node.hpp"
+#include "point_traits.hpp"
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <ostream>
+#include <ranges>
+#include <span>
+#include <type_traits>
+#include <vector>
+
+namespace kdtree {
+
+    // Pointer-free node record. Records are stored in pre-order, so every
+    // subtree occupies a contiguous range of records, and the left child of
+    // a node, if any, is always the next record.
+    struct flat_node {
+        size_t right;  // index of the right child record, end of the left subtree
+        std::uint32_t axis = 0;  // axis the node splits its subtree along
+    };
+
+    inline bool operator==(const flat_node& a, const flat_node& b) {
+        return a.right == b.right && a.axis == b.axis;
+    }
+
+    template<class T, size_t Alignment = 64>
+    struct aligned_allocator {
+        using value_type = T;
+
+        template<class U>
+        struct rebind {
+            using other = aligned_allocator<U, Alignment>;
+        };
+
+        aligned_allocator() = default;
+
+        template<class U>
+        aligned_allocator(const aligned_allocator<U, Alignment>&) {}
+
+        T* allocate(size_t n) {
+            return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(Alignment)));
+        }
+
+        void deallocate(T* p, size_t) {
+            ::operator delete(p, std::align_val_t(Alignment));
+        }
+
+        friend bool operator==(const aligned_allocator&, const aligned_allocator&) {
+            return true;
+        }
+    };
+
+    enum class coordinate_layout {
+        aos,  // points only
+        soa,  // points and a separate aligned array of coordinates per axis
+    };
+
+    // Structure-of-arrays copy of point coordinates: axis a of the i-th
+    // point is at values[a * stride + i]. Every axis array starts at a
+    // 64-byte boundary and the whole array is followed by one more 64-byte
+    // vector, so any bucket can be scanned with whole vector loads.
+    template<class T>
+    struct coordinate_storage {
+        static constexpr size_t alignment = 64;
+        static constexpr size_t lanes = alignment / sizeof(T);
+
+        std::vector<T, aligned_allocator<T, alignment>> values;
+        size_t stride = 0;
+
+        bool empty() const {
+            return values.empty();
+        }
+
+        const T* axis(size_t a) const {
+            return values.data() + a * stride;
+        }
+    };
+
+    // Points of a run-time dimension that keep their coordinates in a
+    // contiguous range, like std::vector<float>. Trees of such points also
+    // keep a packed copy of all coordinates, see packed_storage.
+    template<class Point>
+    concept packed_point =
+        std::ranges::contiguous_range<Point> &&
+        !static_kdim_point<Point> &&
+        std::is_arithmetic_v<std::ranges::range_value_t<Point>> &&
+        std::same_as<std::ranges::range_value_t<Point>, point_distance_t<Point>>;
+
+    // Array-of-structures copy of point coordinates in a single buffer:
+    // axis a of the i-th point is at values[i * stride + a]. The stride is
+    // kdim rounded up to a power of two for points that fit a 64-byte line,
+    // so none of them straddles two lines, and to whole lines otherwise.
+    template<class T>
+    struct packed_storage {
+        static constexpr size_t alignment = 64;
+        static constexpr size_t lanes = alignment / sizeof(T);
+
+        std::vector<T, aligned_allocator<T, alignment>> values;
+        size_t stride = 0;
+
+        bool empty() const {
+            return values.empty();
+        }
+
+        const T* row(size_t i) const {
+            return values.data() + i * stride;
+        }
+    };
+
+    namespace detail {
+        template<class T>
+        size_t packed_stride(const size_t kdim) {
+            constexpr auto lanes = packed_storage<T>::lanes;
+            return kdim <= lanes
+                ? std::bit_ceil(kdim)
+                : (kdim + lanes - 1) / lanes * lanes;
+        }
+
+        template<class Point>
+        auto make_packed(const std::vector<Point>& points, const auto& kdim) {
+
+            using distance_t = point_distance_t<Point>;
+
+            packed_storage<distance_t> packed;
+            packed.stride = packed_stride<distance_t>(size_t(kdim));
+            packed.values.assign(packed.stride * points.size(), {});
+
+            for (size_t i = 0; i < points.size(); ++i) {
+                std::ranges::copy_n(std::ranges::data(points[i]), size_t(kdim), packed.values.data() + i * packed.stride);
+            }
+
+            return packed;
+        }
+
+        template<class Point>
+        auto make_coordinates(const std::vector<Point>& points, const auto& kdim) {
+
+            using distance_t = point_distance_t<Point>;
+
+            coordinate_storage<distance_t> coords;
+            const auto length = points.size();
+            constexpr auto lanes = coordinate_storage<distance_t>::lanes;
+
+            coords.stride = (length + lanes - 1) / lanes * lanes;
+            coords.values.assign(coords.stride * kdim + lanes, {});
+
+            for (size_t axis = 0; axis < size_t(kdim); ++axis) {
+                auto* values = coords.values.data() + axis * coords.stride;
+                for (size_t i = 0; i < length; ++i) {
+                    values[i] = points[i][axis];
+                }
+            }
+
+            return coords;
+        }
+    }
+
+    // Contiguous storage of a whole tree: the point of the i-th node is
+    // points[i], so a whole tree takes just two allocations (three with
+    // coordinate_layout::soa). For packed_point types the coordinates of
+    // points[i] are also at packed.row(i).
+    //
+    // Erased points stay in place with dead[i] set, and live[i] counts the
+    // points not erased in the subtree of record i, so that searches skip
+    // subtrees without any. Both are empty until the first erase.
+    template<class Point>
+    struct node_storage {
+        using point_type = Point;
+
+        std::vector<Point> points;
+        std::vector<flat_node> nodes;
+        coordinate_storage<point_distance_t<Point>> coords;
+        packed_storage<point_distance_t<Point>> packed;
+        std::vector<std::uint8_t> dead;
+        std::vector<size_t> live;
+    };
+
+    // Read-only view of node_storage kept elsewhere, e.g. in a mapped file.
+    // Its members have the interface the searches use of their
+    // counterparts in node_storage, so both are searched by the same code.
+    template<class Point>
+    struct node_storage_view {
+        using point_type = Point;
+        using distance_type = point_distance_t<Point>;
+
+        template<class T>
+        struct array_view {
+            std::span<const T> values;
+            size_t stride = 0;
+
+            bool empty() const {
+                return values.empty();
+            }
+
+            const T* axis(size_t a) const {
+                return values.data() + a * stride;
+            }
+
+            const T* row(size_t i) const {
+                return values.data() + i * stride;
+            }
+        };
+
+        std::span<const Point> points;
+        std::span<const flat_node> nodes;
+        array_view<distance_type> coords;
+        array_view<distance_type> packed;
+        std::span<const std::uint8_t> dead;
+        std::span<const size_t> live;
+    };
+
+    template<class Point>
+    node_storage_view<Point> make_storage_view(const node_storage<Point>& storage) {
+        return {
+            storage.points,
+            storage.nodes,
+            { storage.coords.values, storage.coords.stride },
+            { storage.packed.values, storage.packed.stride },
+            storage.dead,
+            storage.live,
+        };
+    }
+
+    enum class split_rule {
+        round_robin,  // axes in turn, at the median
+        widest_spread,  // axis with the largest extent of points, at the median
+        sliding_midpoint,  // same axis, at the point nearest past the middle of the extent
+    };
+
+    enum class build_method {
+        select,  // std::nth_element on every subtree, O(n log n) expected
+        presort,  // one sort per axis, then stable partitions, O(kn log n)
+    };
+
+    struct build_options {
+        size_t leaf_size = 1;  // largest subtree that is scanned instead of split
+        coordinate_layout layout = coordinate_layout::aos;
+        size_t threads = 1;  // 0 for std::thread::hardware_concurrency()
+        split_rule split = split_rule::round_robin;
+        build_method method = build_method::select;
+        double compact_fraction = 0.5;  // share of erased points that makes erase() rebuild the tree
+    };
+
+    namespace detail {
+        // Adds the packed copy of coordinates to storage made elsewhere,
+        // e.g. by flatten().
+        template<class Point>
+        node_storage<Point> with_packed(node_storage<Point> storage, const int kdim) {
+            if constexpr (packed_point<Point>) {
+                if (storage.packed.empty() && !storage.points.empty()) {
+                    storage.packed = make_packed(storage.points, kdim);
+                }
+            }
+            return storage;
+        }
+    }
+
+    template<class Point>
+    bool operator==(const node_storage<Point>& a, const node_storage<Point>& b) {
+        return a.nodes == b.nodes && a.points == b.points && a.dead == b.dead;
+    }
+
+    // Lightweight handle to a subtree inside node_storage. Behaves like
+    // node_container_t, i.e. it is empty for missing children and can be
+    // dereferenced, so the same code can walk both kinds of trees.
+    template<class Point>
+    class node_view {
+    public:
+        using point_type = Point;
+
+        node_view() = default;
+
+        node_view(const node_storage<Point>& storage, size_t index, size_t end)
+            : storage_(&storage), index_(index), end_(end) {
+        }
+
+        explicit operator bool() const {
+            return index_ != end_;
+        }
+
+        const node_view& operator*() const {
+            return *this;
+        }
+
+        const node_view* operator->() const {
+            return this;
+        }
+
+        size_t index() const {
+            return index_;
+        }
+
+        const Point& value() const {
+            return storage_->points[index_];
+        }
+
+        node_view left() const {
+            return node_view(*storage_, index_ + 1, storage_->nodes[index_].right);
+        }
+
+        node_view right() const {
+            return node_view(*storage_, storage_->nodes[index_].right, end_);
+        }
+
+    private:
+        const node_storage<Point>* storage_ = nullptr;
+        size_t index_ = 0;
+        size_t end_ = 0;
+    };
+
+    template<class Point>
+    node_view<Point> make_root_view(const node_storage<Point>& storage) {
+        return node_view<Point>(storage, 0, storage.nodes.size());
+    }
+
+    // Converts a hand-made tree to node_storage. Nodes are emitted in
+    // pre-order from an explicit stack; the right child of node i, or an
+    // empty marker if it has none, is pushed below its left subtree, so
+    // records[i].right is known when the marker or the child is popped.
+    // Hand-made trees split along axes in turn, the node at depth d along
+    // axis d % kdim.
+    template<class Point>
+    node_storage<Point> flatten(const std::unique_ptr<node<Point>, node_deleter<Point>>& root, const int kdim = 1) {
+        node_storage<Point> storage;
+        if (!root) {
+            return storage;
+        }
+
+        struct pending_node {
+            const node<Point>* value;  // nullptr for an empty right child
+            size_t parent;  // record whose right field starts here
+            std::uint32_t axis;
+        };
+
+        constexpr auto no_parent = ~size_t(0);
+        const auto next_axis = [kdim](std::uint32_t axis) { return int(axis) + 1 >= kdim ? 0 : axis + 1; };
+
+        std::vector<pending_node> pending{ { root.get(), no_parent, 0 } };
+
+        while (!pending.empty()) {
+            const auto [value, parent, axis] = pending.back();
+            pending.pop_back();
+
+            if (parent != no_parent) {
+                storage.nodes[parent].right = storage.nodes.size();
+            }
+
+            if (!value) {
+                continue;
+            }
+
+            const auto index = storage.nodes.size();
+            storage.nodes.push_back({ 0, axis });
+            storage.points.push_back(value->value());
+
+            pending.push_back({ value->right().get(), index, next_axis(axis) });
+            if (value->left()) {
+                pending.push_back({ value->left().get(), no_parent, next_axis(axis) });
+            }
+        }
+
+        return storage;
+    }
+
+    template<point Point>
+    std::ostream& operator<<(
+        std::ostream& os, const node_view<Point>& node) {
+        detail::format(os, node);
+        return os;
+    }
+}
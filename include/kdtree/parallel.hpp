@@ -0,0 +1,85 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace kdtree {
+
+    struct batch_options {
+        size_t threads = 1;  // 0 for std::thread::hardware_concurrency()
+        size_t chunk_size = 256;  // keys taken by a worker at a time
+        double eps = 0;  // approximation factor, see tree::find_nearest
+    };
+
+    namespace detail {
+
+        inline size_t resolve_threads(const size_t threads) {
+            return threads > 0
+                ? threads
+                : std::max<size_t>(std::thread::hardware_concurrency(), 1);
+        }
+
+        // Calls fn(first, last) for consecutive chunks of [0, count). Workers
+        // take the next chunk from a shared counter as soon as they are done
+        // with the previous one, so a few expensive chunks do not leave the
+        // other threads idle. The calling thread is one of the workers.
+        template<class Fn>
+        void parallel_for_chunks(
+            const size_t count,
+            const size_t threads,
+            const size_t chunk_size,
+            Fn&& fn) {
+
+            const auto chunk = std::max<size_t>(chunk_size, 1);
+            const auto num_chunks = (count + chunk - 1) / chunk;
+            const auto num_workers = std::min(resolve_threads(threads), num_chunks);
+
+            if (num_workers <= 1) {
+                if (count > 0) {
+                    fn(size_t(0), count);
+                }
+                return;
+            }
+
+            std::atomic<size_t> next{ 0 };
+            std::exception_ptr error;
+            std::mutex error_mutex;
+
+            auto worker = [&]() {
+                try {
+                    for (auto first = next.fetch_add(chunk); first < count; first = next.fetch_add(chunk)) {
+                        fn(first, std::min(first + chunk, count));
+                    }
+                }
+                catch (...) {
+                    const std::lock_guard lock(error_mutex);
+                    if (!error) {
+                        error = std::current_exception();
+                    }
+                    next = count;
+                }
+            };
+
+            std::vector<std::thread> pool;
+            pool.reserve(num_workers - 1);
+            for (size_t i = 1; i < num_workers; ++i) {
+                pool.emplace_back(worker);
+            }
+
+            worker();
+
+            for (auto& t : pool) {
+                t.join();
+            }
+
+            if (error) {
+                std::rethrow_exception(error);
+            }
+        }
+    }
+}
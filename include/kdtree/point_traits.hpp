@@ -18,6 +18,12 @@ namespace kdtree {
     template<typename T>
     constexpr auto point_kdim_v = point_kdim<T>::value;
 
+    // Points with a dimension known at compile time, i.e. with point_kdim_v.
+    template<typename T>
+    concept static_kdim_point = requires {
+        { point_kdim<T>::value } -> std::convertible_to<size_t>;
+    };
+
     template<typename>
     struct point_distance;
 
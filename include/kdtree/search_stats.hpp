@@ -0,0 +1,47 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+
+namespace kdtree {
+
+    // Work done by searches, to find out why some queries take much longer
+    // than others. Queries given a search_stats add to it, so it can sum up
+    // one query or many; start over with stats = {}.
+    struct search_stats {
+        size_t nodes_visited = 0;  // split nodes whose point was checked
+        size_t distance_evaluations = 0;  // distances computed, a bucket scan counts its whole bucket
+        size_t far_descents = 0;  // subtrees on the far side of a split searched after all
+        size_t leaf_scans = 0;  // buckets scanned
+        size_t max_stack_depth = 0;  // most subtrees waiting on the stack at once
+
+        void visit_node() {
+            ++nodes_visited;
+            ++distance_evaluations;
+        }
+
+        void scan_leaf(const size_t size) {
+            ++leaf_scans;
+            distance_evaluations += size;
+        }
+
+        void descend_far() {
+            ++far_descents;
+        }
+
+        void stack_depth(const size_t depth) {
+            max_stack_depth = std::max(max_stack_depth, depth);
+        }
+    };
+
+    namespace detail {
+        // Statistics of queries that did not ask for them, every hook is
+        // empty and the searches compile as if there were none.
+        struct no_search_stats {
+            void visit_node() {}
+            void scan_leaf(size_t) {}
+            void descend_far() {}
+            void stack_depth(size_t) {}
+        };
+    }
+}
@@ -0,0 +1,470 @@
+#pragma once
+
+#include "point_traits.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <limits>
+#include <ranges>
+#include <type_traits>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define KDTREE_SIMD_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+#else
+#define KDTREE_SIMD_X86 0
+#endif
+
+// Kernels for wider instruction sets are compiled with function-level
+// target attributes, so the library does not need -mavx2 or similar
+// flags and the best kernel is picked at run-time.
+#if defined(__GNUC__) || defined(__clang__)
+#define KDTREE_TARGET(isa) __attribute__((target(isa)))
+#else
+#define KDTREE_TARGET(isa)
+#endif
+
+namespace kdtree {
+
+    enum class simd_level {
+        scalar,
+        sse2,
+        avx2,
+        avx512,
+    };
+
+    inline simd_level detect_simd_level() {
+#if KDTREE_SIMD_X86
+#if defined(_MSC_VER) && !defined(__clang__)
+        int info[4];
+        __cpuid(info, 0);
+        const auto max_leaf = info[0];
+
+        __cpuid(info, 1);
+        const bool sse2 = info[3] & (1 << 26);
+        const bool osxsave = info[2] & (1 << 27);
+        const auto xcr0 = osxsave ? _xgetbv(0) : 0;
+        const bool ymm_state = (xcr0 & 0x06) == 0x06;
+        const bool zmm_state = (xcr0 & 0xe6) == 0xe6;
+
+        bool avx2 = false;
+        bool avx512 = false;
+        if (max_leaf >= 7) {
+            __cpuidex(info, 7, 0);
+            avx2 = ymm_state && (info[1] & (1 << 5));
+            avx512 = zmm_state && (info[1] & (1 << 16));
+        }
+#else
+        __builtin_cpu_init();
+        const bool sse2 = __builtin_cpu_supports("sse2");
+        const bool avx2 = __builtin_cpu_supports("avx2");
+        const bool avx512 = __builtin_cpu_supports("avx512f");
+#endif
+        if (avx512) return simd_level::avx512;
+        if (avx2) return simd_level::avx2;
+        if (sse2) return simd_level::sse2;
+#endif
+        return simd_level::scalar;
+    }
+
+    inline simd_level max_simd_level() {
+        static const auto level = detect_simd_level();
+        return level;
+    }
+}
+
+namespace kdtree::detail {
+
+    constexpr size_t dist_block_size = 64;
+
+    // Buffer for the distances of a block of points, declare it alignas(64).
+    template<point Point>
+    using dist_block_t = std::array<point_distance_t<Point>, dist_block_size>;
+
+    // Squared distances from key to count consecutive points of
+    // structure-of-arrays coordinates, where axis a of the j-th point is
+    // coords[a * stride + j]. Writes dists[0, count) and returns their
+    // minimum. Kernels may read and write up to 64 bytes past count, so
+    // coordinates must be padded and dists must hold a multiple of 64 bytes.
+    template<point Point>
+    using dist_block_kernel_t = point_distance_t<Point>(*)(
+        const point_distance_t<Point>* coords,
+        size_t stride,
+        const Point& key,
+        size_t kdim,
+        size_t count,
+        point_distance_t<Point>* dists);
+
+    // Every kernel adds squared coordinate differences one axis after
+    // another without fused multiply-add, exactly like dist_sqr, so all of
+    // them produce bit-identical distances.
+    template<point Point>
+    point_distance_t<Point> dist_block_scalar(
+        const point_distance_t<Point>* coords,
+        size_t stride,
+        const Point& key,
+        size_t kdim,
+        size_t count,
+        point_distance_t<Point>* dists) {
+
+        using distance_t = point_distance_t<Point>;
+
+        std::fill_n(dists, count, distance_t(0));
+
+        for (size_t axis = 0; axis < kdim; ++axis) {
+            const auto* axis_coords = coords + axis * stride;
+            const distance_t key_at_axis = key[axis];
+            for (size_t j = 0; j < count; ++j) {
+                const auto d = axis_coords[j] - key_at_axis;
+                dists[j] += d * d;
+            }
+        }
+
+        return *std::min_element(dists, dists + count);
+    }
+
+#if KDTREE_SIMD_X86
+
+    template<class T>
+    void fill_dist_tail(T* dists, size_t count, size_t padded) {
+        std::fill(dists + count, dists + padded, std::numeric_limits<T>::max());
+    }
+
+    template<point Point>
+    KDTREE_TARGET("sse2")
+    point_distance_t<Point> dist_block_sse2(
+        const point_distance_t<Point>* coords,
+        size_t stride,
+        const Point& key,
+        size_t kdim,
+        size_t count,
+        point_distance_t<Point>* dists) {
+
+        using distance_t = point_distance_t<Point>;
+
+        if constexpr (std::same_as<distance_t, float>) {
+            const auto padded = (count + 3) / 4 * 4;
+            for (size_t j = 0; j < padded; j += 4) {
+                auto acc = _mm_setzero_ps();
+                for (size_t axis = 0; axis < kdim; ++axis) {
+                    const auto c = _mm_loadu_ps(coords + axis * stride + j);
+                    const auto d = _mm_sub_ps(c, _mm_set1_ps(key[axis]));
+                    acc = _mm_add_ps(acc, _mm_mul_ps(d, d));
+                }
+                _mm_store_ps(dists + j, acc);
+            }
+            fill_dist_tail(dists, count, padded);
+
+            auto m = _mm_load_ps(dists);
+            for (size_t j = 4; j < padded; j += 4) {
+                m = _mm_min_ps(m, _mm_load_ps(dists + j));
+            }
+            m = _mm_min_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+            m = _mm_min_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+            return _mm_cvtss_f32(m);
+        }
+        else if constexpr (std::same_as<distance_t, double>) {
+            const auto padded = (count + 1) / 2 * 2;
+            for (size_t j = 0; j < padded; j += 2) {
+                auto acc = _mm_setzero_pd();
+                for (size_t axis = 0; axis < kdim; ++axis) {
+                    const auto c = _mm_loadu_pd(coords + axis * stride + j);
+                    const auto d = _mm_sub_pd(c, _mm_set1_pd(key[axis]));
+                    acc = _mm_add_pd(acc, _mm_mul_pd(d, d));
+                }
+                _mm_store_pd(dists + j, acc);
+            }
+            fill_dist_tail(dists, count, padded);
+
+            auto m = _mm_load_pd(dists);
+            for (size_t j = 2; j < padded; j += 2) {
+                m = _mm_min_pd(m, _mm_load_pd(dists + j));
+            }
+            m = _mm_min_pd(m, _mm_unpackhi_pd(m, m));
+            return _mm_cvtsd_f64(m);
+        }
+        else {
+            return dist_block_scalar(coords, stride, key, kdim, count, dists);
+        }
+    }
+
+    template<point Point>
+    KDTREE_TARGET("avx2")
+    point_distance_t<Point> dist_block_avx2(
+        const point_distance_t<Point>* coords,
+        size_t stride,
+        const Point& key,
+        size_t kdim,
+        size_t count,
+        point_distance_t<Point>* dists) {
+
+        using distance_t = point_distance_t<Point>;
+
+        if constexpr (std::same_as<distance_t, float>) {
+            const auto padded = (count + 7) / 8 * 8;
+            for (size_t j = 0; j < padded; j += 8) {
+                auto acc = _mm256_setzero_ps();
+                for (size_t axis = 0; axis < kdim; ++axis) {
+                    const auto c = _mm256_loadu_ps(coords + axis * stride + j);
+                    const auto d = _mm256_sub_ps(c, _mm256_set1_ps(key[axis]));
+                    acc = _mm256_add_ps(acc, _mm256_mul_ps(d, d));
+                }
+                _mm256_store_ps(dists + j, acc);
+            }
+            fill_dist_tail(dists, count, padded);
+
+            auto m = _mm256_load_ps(dists);
+            for (size_t j = 8; j < padded; j += 8) {
+                m = _mm256_min_ps(m, _mm256_load_ps(dists + j));
+            }
+            auto h = _mm_min_ps(_mm256_castps256_ps128(m), _mm256_extractf128_ps(m, 1));
+            h = _mm_min_ps(h, _mm_shuffle_ps(h, h, _MM_SHUFFLE(1, 0, 3, 2)));
+            h = _mm_min_ps(h, _mm_shuffle_ps(h, h, _MM_SHUFFLE(2, 3, 0, 1)));
+            return _mm_cvtss_f32(h);
+        }
+        else if constexpr (std::same_as<distance_t, double>) {
+            const auto padded = (count + 3) / 4 * 4;
+            for (size_t j = 0; j < padded; j += 4) {
+                auto acc = _mm256_setzero_pd();
+                for (size_t axis = 0; axis < kdim; ++axis) {
+                    const auto c = _mm256_loadu_pd(coords + axis * stride + j);
+                    const auto d = _mm256_sub_pd(c, _mm256_set1_pd(key[axis]));
+                    acc = _mm256_add_pd(acc, _mm256_mul_pd(d, d));
+                }
+                _mm256_store_pd(dists + j, acc);
+            }
+            fill_dist_tail(dists, count, padded);
+
+            auto m = _mm256_load_pd(dists);
+            for (size_t j = 4; j < padded; j += 4) {
+                m = _mm256_min_pd(m, _mm256_load_pd(dists + j));
+            }
+            auto h = _mm_min_pd(_mm256_castpd256_pd128(m), _mm256_extractf128_pd(m, 1));
+            h = _mm_min_pd(h, _mm_unpackhi_pd(h, h));
+            return _mm_cvtsd_f64(h);
+        }
+        else {
+            return dist_block_scalar(coords, stride, key, kdim, count, dists);
+        }
+    }
+
+    template<point Point>
+    KDTREE_TARGET("avx512f")
+    point_distance_t<Point> dist_block_avx512(
+        const point_distance_t<Point>* coords,
+        size_t stride,
+        const Point& key,
+        size_t kdim,
+        size_t count,
+        point_distance_t<Point>* dists) {
+
+        using distance_t = point_distance_t<Point>;
+
+        if constexpr (std::same_as<distance_t, float>) {
+            const auto padded = (count + 15) / 16 * 16;
+            for (size_t j = 0; j < padded; j += 16) {
+                auto acc = _mm512_setzero_ps();
+                for (size_t axis = 0; axis < kdim; ++axis) {
+                    const auto c = _mm512_loadu_ps(coords + axis * stride + j);
+                    const auto d = _mm512_sub_ps(c, _mm512_set1_ps(key[axis]));
+                    acc = _mm512_add_ps(acc, _mm512_mul_ps(d, d));
+                }
+                _mm512_store_ps(dists + j, acc);
+            }
+            fill_dist_tail(dists, count, padded);
+
+            auto m = _mm512_load_ps(dists);
+            for (size_t j = 16; j < padded; j += 16) {
+                m = _mm512_min_ps(m, _mm512_load_ps(dists + j));
+            }
+            return _mm512_reduce_min_ps(m);
+        }
+        else if constexpr (std::same_as<distance_t, double>) {
+            const auto padded = (count + 7) / 8 * 8;
+            for (size_t j = 0; j < padded; j += 8) {
+                auto acc = _mm512_setzero_pd();
+                for (size_t axis = 0; axis < kdim; ++axis) {
+                    const auto c = _mm512_loadu_pd(coords + axis * stride + j);
+                    const auto d = _mm512_sub_pd(c, _mm512_set1_pd(key[axis]));
+                    acc = _mm512_add_pd(acc, _mm512_mul_pd(d, d));
+                }
+                _mm512_store_pd(dists + j, acc);
+            }
+            fill_dist_tail(dists, count, padded);
+
+            auto m = _mm512_load_pd(dists);
+            for (size_t j = 8; j < padded; j += 8) {
+                m = _mm512_min_pd(m, _mm512_load_pd(dists + j));
+            }
+            return _mm512_reduce_min_pd(m);
+        }
+        else {
+            return dist_block_scalar(coords, stride, key, kdim, count, dists);
+        }
+    }
+
+#endif
+
+    // Squared distance between two contiguous arrays of n coordinates.
+    // Vector kernels keep several partial sums, so unlike the block kernels
+    // above they may differ from dist_sqr in the last bits of the result.
+    template<class T>
+    using dist_sqr_kernel_t = T(*)(const T* a, const T* b, size_t n);
+
+    template<class T>
+    T dist_sqr_scalar(const T* a, const T* b, size_t n) {
+        auto dist = T(0);
+        for (size_t i = 0; i < n; ++i) {
+            const auto d = a[i] - b[i];
+            dist += d * d;
+        }
+        return dist;
+    }
+
+#if KDTREE_SIMD_X86
+
+    template<class T>
+    KDTREE_TARGET("sse2")
+    T dist_sqr_sse2(const T* a, const T* b, size_t n) {
+        size_t i = 0;
+        T dist;
+        if constexpr (std::same_as<T, float>) {
+            auto acc = _mm_setzero_ps();
+            for (; i + 4 <= n; i += 4) {
+                const auto d = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+                acc = _mm_add_ps(acc, _mm_mul_ps(d, d));
+            }
+            acc = _mm_add_ps(acc, _mm_shuffle_ps(acc, acc, _MM_SHUFFLE(1, 0, 3, 2)));
+            acc = _mm_add_ps(acc, _mm_shuffle_ps(acc, acc, _MM_SHUFFLE(2, 3, 0, 1)));
+            dist = _mm_cvtss_f32(acc);
+        }
+        else {
+            auto acc = _mm_setzero_pd();
+            for (; i + 2 <= n; i += 2) {
+                const auto d = _mm_sub_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i));
+                acc = _mm_add_pd(acc, _mm_mul_pd(d, d));
+            }
+            acc = _mm_add_pd(acc, _mm_unpackhi_pd(acc, acc));
+            dist = _mm_cvtsd_f64(acc);
+        }
+        return dist + dist_sqr_scalar(a + i, b + i, n - i);
+    }
+
+    template<class T>
+    KDTREE_TARGET("avx2")
+    T dist_sqr_avx2(const T* a, const T* b, size_t n) {
+        size_t i = 0;
+        T dist;
+        if constexpr (std::same_as<T, float>) {
+            auto acc = _mm256_setzero_ps();
+            for (; i + 8 <= n; i += 8) {
+                const auto d = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+                acc = _mm256_add_ps(acc, _mm256_mul_ps(d, d));
+            }
+            auto h = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+            h = _mm_add_ps(h, _mm_shuffle_ps(h, h, _MM_SHUFFLE(1, 0, 3, 2)));
+            h = _mm_add_ps(h, _mm_shuffle_ps(h, h, _MM_SHUFFLE(2, 3, 0, 1)));
+            dist = _mm_cvtss_f32(h);
+        }
+        else {
+            auto acc = _mm256_setzero_pd();
+            for (; i + 4 <= n; i += 4) {
+                const auto d = _mm256_sub_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i));
+                acc = _mm256_add_pd(acc, _mm256_mul_pd(d, d));
+            }
+            auto h = _mm_add_pd(_mm256_castpd256_pd128(acc), _mm256_extractf128_pd(acc, 1));
+            h = _mm_add_pd(h, _mm_unpackhi_pd(h, h));
+            dist = _mm_cvtsd_f64(h);
+        }
+        return dist + dist_sqr_scalar(a + i, b + i, n - i);
+    }
+
+    template<class T>
+    KDTREE_TARGET("avx512f")
+    T dist_sqr_avx512(const T* a, const T* b, size_t n) {
+        size_t i = 0;
+        T dist;
+        if constexpr (std::same_as<T, float>) {
+            auto acc = _mm512_setzero_ps();
+            for (; i + 16 <= n; i += 16) {
+                const auto d = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+                acc = _mm512_add_ps(acc, _mm512_mul_ps(d, d));
+            }
+            dist = _mm512_reduce_add_ps(acc);
+        }
+        else {
+            auto acc = _mm512_setzero_pd();
+            for (; i + 8 <= n; i += 8) {
+                const auto d = _mm512_sub_pd(_mm512_loadu_pd(a + i), _mm512_loadu_pd(b + i));
+                acc = _mm512_add_pd(acc, _mm512_mul_pd(d, d));
+            }
+            dist = _mm512_reduce_add_pd(acc);
+        }
+        return dist + dist_sqr_scalar(a + i, b + i, n - i);
+    }
+
+#endif
+
+    template<class T>
+    dist_sqr_kernel_t<T> get_dist_sqr_kernel(simd_level level) {
+#if KDTREE_SIMD_X86
+        if constexpr (std::same_as<T, float> || std::same_as<T, double>) {
+            switch (std::min(level, max_simd_level())) {
+            case simd_level::avx512:
+                return &dist_sqr_avx512<T>;
+            case simd_level::avx2:
+                return &dist_sqr_avx2<T>;
+            case simd_level::sse2:
+                return &dist_sqr_sse2<T>;
+            default:
+                break;
+            }
+        }
+#endif
+        return &dist_sqr_scalar<T>;
+    }
+
+    template<class T>
+    dist_sqr_kernel_t<T> dist_sqr_kernel() {
+        static const auto kernel = get_dist_sqr_kernel<T>(max_simd_level());
+        return kernel;
+    }
+
+    // Points stored as contiguous arrays of floating point coordinates,
+    // for which dist_sqr can use dist_sqr_kernel.
+    template<class Point>
+    concept contiguous_point =
+        std::ranges::contiguous_range<Point> &&
+        std::floating_point<std::ranges::range_value_t<Point>> &&
+        std::same_as<std::ranges::range_value_t<Point>, point_distance_t<Point>>;
+
+    // dist_sqr_kernel only pays off for long vectors
+    constexpr size_t dist_sqr_kernel_min_kdim = 16;
+
+    template<point Point>
+    dist_block_kernel_t<Point> get_dist_block_kernel(simd_level level) {
+#if KDTREE_SIMD_X86
+        switch (std::min(level, max_simd_level())) {
+        case simd_level::avx512:
+            return &dist_block_avx512<Point>;
+        case simd_level::avx2:
+            return &dist_block_avx2<Point>;
+        case simd_level::sse2:
+            return &dist_block_sse2<Point>;
+        default:
+            break;
+        }
+#endif
+        return &dist_block_scalar<Point>;
+    }
+
+    template<point Point>
+    dist_block_kernel_t<Point> dist_block_kernel() {
+        static const auto kernel = get_dist_block_kernel<Point>(max_simd_level());
+        return kernel;
+    }
+}
@@ -2,13 +2,18 @@
 
 #include "tree_detail.hpp"
 #include "node.hpp"
+#include "node_storage.hpp"
+#include "parallel.hpp"
 #include "point_traits.hpp"
+#include "search_stats.hpp"
+#include "tree_stats.hpp"
 
 #include <algorithm>
 #include <ostream>
 #include <vector>
 #include <numeric>
 #include <ranges>
+#include <span>
 #include <type_traits>
 
 namespace kdtree {
@@ -18,63 +23,323 @@ namespace kdtree {
         std::ranges::sized_range<Range> &&
         std::convertible_to<std::ranges::range_value_t<Range>, size_t>;
 
+    template<class Range, class Point>
+    concept keys_range =
+        std::ranges::random_access_range<Range> &&
+        std::ranges::sized_range<Range> &&
+        std::convertible_to<std::ranges::range_reference_t<Range>, const Point&>;
+
+    template<class Range, class T>
+    concept results_range =
+        std::ranges::random_access_range<Range> &&
+        std::ranges::output_range<Range, T>;
+
+    // Query result together with its squared distance to the key. Value is
+    // a point for tree and an index for index_tree.
+    template<class Value, class Distance>
+    struct neighbor {
+        Value value;
+        Distance distance_sqr;
+
+        friend bool operator==(const neighbor&, const neighbor&) = default;
+    };
+
     template<point Point>
     class tree {
     public:
 
         using point_type = Point;
         using distance_type = point_distance_t<Point>;
+        using neighbor_type = neighbor<Point, distance_type>;
 
+        // For points with point_kdim_v, whose dimension is part of the type,
+        // kdim must be that dimension or 0, else std::invalid_argument is
+        // thrown.
         tree()
-            : root_(make_leaf<Point>())
-            , kdim_(0) {}
+            : kdim_(detail::make_kdim<Point>(0))
+            , leaf_size_(1) {}
 
         tree(const int kdim)
-            : root_(make_leaf<Point>())
-            , kdim_(kdim) {}
+            : kdim_(detail::make_kdim<Point>(kdim))
+            , leaf_size_(1) {}
 
-        tree(node<Point>::container_type root, int kdim)
-            : root_(std::move(root))
-            , kdim_(kdim) {}
+        tree(const node_container_t<Point>& root, int kdim)
+            : storage_(detail::with_packed(flatten(root, int(detail::make_kdim<Point>(kdim))), int(detail::make_kdim<Point>(kdim))))
+            , kdim_(detail::make_kdim<Point>(kdim))
+            , leaf_size_(1) {}
+
+        tree(node_storage<Point> storage, int kdim, size_t leaf_size = 1)
+            : storage_(detail::with_packed(std::move(storage), int(detail::make_kdim<Point>(kdim))))
+            , kdim_(detail::make_kdim<Point>(kdim))
+            , leaf_size_(leaf_size) {
+            options_.leaf_size = leaf_size;
+            options_.layout = storage_.coords.empty() ? coordinate_layout::aos : coordinate_layout::soa;
+        }
 
         tree(const tree& other) = delete;
 
-        tree(tree&& other) {
-            std::swap(root_, other.root_);
+        tree(tree&& other)
+            : kdim_(detail::make_kdim<Point>(0))
+            , leaf_size_(1) {
+            std::swap(storage_, other.storage_);
+            std::swap(kdim_, other.kdim_);
+            std::swap(leaf_size_, other.leaf_size_);
+            std::swap(options_, other.options_);
         }
 
         tree& operator=(tree&& other) {
-            std::swap(root_, other.root_);
+            std::swap(storage_, other.storage_);
             std::swap(kdim_, other.kdim_);
+            std::swap(leaf_size_, other.leaf_size_);
+            std::swap(options_, other.options_);
             return *this;
         }
 
         template<points_range Points>
         requires std::same_as<points_range_point_t<Points>, Point>
-        static tree build(const Points& points, int kdim) {
-            auto root = detail::build(points, kdim);
-            return tree(std::move(root), kdim);
+        static tree build(const Points& points, int kdim, const build_options& options = {}) {
+            return from_storage(detail::build(points, kdim, options), kdim, options);
+        }
+
+        // Takes over the points without copying them, they become the
+        // storage of the tree in tree order.
+        static tree build(std::vector<Point>&& points, int kdim, const build_options& options = {}) {
+            return from_storage(detail::build(std::move(points), kdim, options), kdim, options);
+        }
+
+        // leaf_size is the largest number of points in a subtree that is
+        // scanned linearly instead of being split further
+        template<points_range Points>
+        requires std::same_as<points_range_point_t<Points>, Point>
+        static tree build(const Points& points, int kdim, size_t leaf_size) {
+            return build(points, kdim, build_options{ .leaf_size = leaf_size });
+        }
+
+        // Gives up the storage, the tree is left empty.
+        node_storage<Point> release() {
+            node_storage<Point> storage;
+            std::swap(storage, storage_);
+            return storage;
+        }
+
+        node_view<Point> root() const {
+            return make_root_view(storage_);
+        }
+
+        const node_storage<Point>& storage() const {
+            return storage_;
         }
 
-        const typename node<Point>::container_type& root() const {
-            return root_;
+        size_t leaf_size() const {
+            return leaf_size_;
+        }
+
+        int kdim() const {
+            return int(kdim_);
+        }
+
+        // number of points not erased
+        constexpr size_t size() const {
+            return detail::live_size(storage_);
         }
 
         constexpr bool is_empty() const {
-            return !root_;
+            return size() == 0;
+        }
+
+        // Shape and memory use, computed in one pass over the nodes.
+        tree_stats stats() const {
+            return detail::make_tree_stats(storage_, size_t(kdim()), leaf_size_);
+        }
+
+        // Erases one point equal to point in all coordinates and returns
+        // false if there is none. The point stays in storage() marked as
+        // dead and is skipped by all queries until the tree rebuilds itself
+        // from the remaining points, once the share of erased points
+        // exceeds build_options::compact_fraction.
+        bool erase(const Point& point) {
+            auto index = storage_.nodes.size();
+            detail::visit_within_radius(storage_, point, kdim_, distance_type(0), leaf_size_,
+                [&index](size_t i, const distance_type&) { index = std::min(index, i); });
+
+            if (index == storage_.nodes.size()) {
+                return false;
+            }
+
+            detail::erase(storage_, index);
+
+            if (double(storage_.nodes.size() - size()) > options_.compact_fraction * double(storage_.nodes.size())) {
+                compact();
+            }
+
+            return true;
+        }
+
+        // Rebuilds the tree from the points not erased.
+        void compact() {
+            if (storage_.dead.empty()) {
+                return;
+            }
+
+            std::vector<Point> points;
+            points.reserve(size());
+            for (size_t i = 0; i < storage_.points.size(); ++i) {
+                if (!storage_.dead[i]) {
+                    points.push_back(std::move(storage_.points[i]));
+                }
+            }
+
+            storage_ = detail::build(std::move(points), kdim(), options_);
+        }
+
+        // With eps > 0 the search is approximate: the distance to every
+        // returned point is at most (1 + eps) times the distance to the
+        // corresponding exact result.
+        Point find_nearest(const Point& key, const double eps = 0) const {
+            return detail::find_nearest(storage_, key, kdim_, leaf_size_, eps);
+        }
+
+        std::vector<Point> find_nearest_n(const Point& key, const auto& num, const double eps = 0) const {
+            return detail::find_nearest_n(storage_, key, kdim_, num, leaf_size_, eps);
         }
 
-        Point find_nearest(const Point& key) const {
-            return detail::find_nearest(root_, key, kdim_);
+        // Like find_nearest, with the squared distance to the key. For an
+        // empty tree the distance is std::numeric_limits<distance_type>::max().
+        neighbor_type find_nearest_neighbor(const Point& key, const double eps = 0) const {
+            return nearest_neighbor(key, eps, detail::no_search_stats{});
         }
 
-        std::vector<Point> find_nearest_n(const Point& key, const auto& num) const {
-            return detail::find_nearest_n(root_, key, kdim_, num);
+        // The overloads taking a search_stats add the work done by the
+        // query to stats, the others count nothing and cost nothing extra.
+        neighbor_type find_nearest_neighbor(const Point& key, search_stats& stats, const double eps = 0) const {
+            return nearest_neighbor(key, eps, stats);
+        }
+
+        // Writes up to out.size() nearest points with their squared
+        // distances to out, in order of distance, and returns their number.
+        // Does not allocate, apart from growing a per-thread scratch heap.
+        size_t find_nearest_neighbors(const Point& key, std::span<neighbor_type> out, const double eps = 0) const {
+            return nearest_neighbors(key, out, eps, detail::no_search_stats{});
+        }
+
+        size_t find_nearest_neighbors(const Point& key, std::span<neighbor_type> out, search_stats& stats, const double eps = 0) const {
+            return nearest_neighbors(key, out, eps, stats);
+        }
+
+        // Radius queries find every point p with distance(key, p) <= radius,
+        // in no particular order.
+        template<class Visitor>
+        requires std::invocable<Visitor&, const Point&>
+        void visit_within_radius(const Point& key, const distance_type& radius, Visitor&& visitor) const {
+            detail::visit_within_radius(storage_, key, kdim_, radius_sqr(radius), leaf_size_,
+                [this, &visitor](size_t index, const distance_type&) { visitor(storage_.points[index]); });
+        }
+
+        template<class Container>
+        requires requires(Container& c, const Point& p) { c.push_back(p); }
+        void find_within_radius(const Point& key, const distance_type& radius, Container& out) const {
+            visit_within_radius(key, radius, [&out](const Point& p) { out.push_back(p); });
+        }
+
+        std::vector<Point> find_within_radius(const Point& key, const distance_type& radius) const {
+            std::vector<Point> out;
+            find_within_radius(key, radius, out);
+            return out;
+        }
+
+        size_t count_within_radius(const Point& key, const distance_type& radius) const {
+            return count_within(key, radius, detail::no_search_stats{});
+        }
+
+        size_t count_within_radius(const Point& key, const distance_type& radius, search_stats& stats) const {
+            return count_within(key, radius, stats);
+        }
+
+        // Batch queries write the answer for keys[i] to out[i], out must be
+        // at least as long as keys. Keys are split into chunks that worker
+        // threads take one at a time, see batch_options.
+        template<keys_range<Point> Keys, results_range<Point> Out>
+        void find_nearest_batch(const Keys& keys, Out&& out, const batch_options& options = {}) const {
+            const auto keys_it = std::ranges::begin(keys);
+            const auto out_it = std::ranges::begin(out);
+
+            detail::parallel_for_chunks(std::ranges::size(keys), options.threads, options.chunk_size,
+                [&](size_t first, size_t last) {
+                    for (auto i = first; i < last; ++i) {
+                        out_it[i] = detail::find_nearest(storage_, keys_it[i], kdim_, leaf_size_, options.eps);
+                    }
+                });
+        }
+
+        template<keys_range<Point> Keys>
+        std::vector<Point> find_nearest_batch(const Keys& keys, const batch_options& options = {}) const {
+            std::vector<Point> out(std::ranges::size(keys));
+            find_nearest_batch(keys, out, options);
+            return out;
+        }
+
+        template<keys_range<Point> Keys, results_range<std::vector<Point>> Out>
+        void find_nearest_n_batch(const Keys& keys, const auto& num, Out&& out, const batch_options& options = {}) const {
+            const auto keys_it = std::ranges::begin(keys);
+            const auto out_it = std::ranges::begin(out);
+
+            detail::parallel_for_chunks(std::ranges::size(keys), options.threads, options.chunk_size,
+                [&](size_t first, size_t last) {
+                    detail::result_heap<Point> results;
+                    for (auto i = first; i < last; ++i) {
+                        detail::results_to_points(
+                            storage_, detail::find_nearest_n(storage_, keys_it[i], kdim_, num, leaf_size_, options.eps, results), out_it[i]);
+                    }
+                });
+        }
+
+        template<keys_range<Point> Keys>
+        std::vector<std::vector<Point>> find_nearest_n_batch(
+            const Keys& keys, const auto& num, const batch_options& options = {}) const {
+            std::vector<std::vector<Point>> out(std::ranges::size(keys));
+            find_nearest_n_batch(keys, num, out, options);
+            return out;
         }
 
     private:
-        typename node<Point>::container_type root_;
-        int kdim_;
+        static tree from_storage(node_storage<Point> storage, int kdim, const build_options& options) {
+            tree result(std::move(storage), kdim, std::max<size_t>(options.leaf_size, 1));
+            result.options_ = options;
+            result.options_.leaf_size = result.leaf_size_;
+            return result;
+        }
+
+        template<class Stats>
+        neighbor_type nearest_neighbor(const Point& key, const double eps, Stats&& stats) const {
+            const auto [index, dist] = detail::find_nearest_result(storage_, key, kdim_, leaf_size_, eps, stats);
+            return { is_empty() ? Point{} : storage_.points[index], dist };
+        }
+
+        template<class Stats>
+        size_t nearest_neighbors(const Point& key, std::span<neighbor_type> out, const double eps, Stats&& stats) const {
+            const auto& results = detail::find_nearest_n(
+                storage_, key, kdim_, out.size(), leaf_size_, eps, detail::thread_result_heap<Point>(), stats);
+            std::ranges::transform(results, out.begin(),
+                [this](const auto& res) { return neighbor_type{ storage_.points[res.first], res.second }; });
+            return results.size();
+        }
+
+        template<class Stats>
+        size_t count_within(const Point& key, const distance_type& radius, Stats&& stats) const {
+            size_t count = 0;
+            detail::visit_within_radius(storage_, key, kdim_, radius_sqr(radius), leaf_size_,
+                [&count](size_t, const distance_type&) { ++count; }, stats);
+            return count;
+        }
+
+        static distance_type radius_sqr(const distance_type& radius) {
+            return radius < 0 ? distance_type(-1) : radius * radius;
+        }
+
+        node_storage<Point> storage_;
+        [[no_unique_address]] detail::kdim_type_t<Point> kdim_;
+        size_t leaf_size_;
+        build_options options_;  // for rebuilds
     };
 
     template<point Point>
@@ -90,9 +355,7 @@ namespace kdtree {
     bool operator==(
         const tree<Point>& a,
         const tree<Point>& b) {
-        if (bool(a.root()) != bool(b.root())) return false;
-        if (a.root() && *a.root() != *b.root()) return false;
-        return true;
+        return a.storage() == b.storage();
     }
 
     template<point Point, class... Args>
@@ -104,14 +367,23 @@ namespace kdtree {
     using points_range_tree_t = tree<points_range_point_t<Points>>;
 
     template<points_range Points>
-    points_range_tree_t<Points> build_tree(Points& points) {
+    points_range_tree_t<Points> build_tree(Points& points, const build_options& options = {}) {
         using point_t = points_range_point_t<Points>;
-        return points_range_tree_t<Points>::build(points, point_kdim_v<point_t>);
+        return points_range_tree_t<Points>::build(points, point_kdim_v<point_t>, options);
+    }
+
+    template<points_range Points>
+    points_range_tree_t<Points> build_tree(Points& points, size_t leaf_size) {
+        return build_tree(points, build_options{ .leaf_size = leaf_size });
+    }
+
+    template<point Point>
+    tree<Point> build_tree(std::vector<Point>&& points, const build_options& options = {}) {
+        return tree<Point>::build(std::move(points), point_kdim_v<Point>, options);
     }
 
     template<point Point>
     tree<Point> build_tree(std::initializer_list<Point>&& points) {
-        std::vector points_vec(std::forward<std::initializer_list<Point>>(points));
-        return tree<Point>::build(points_vec, point_kdim_v<Point>);
+        return build_tree(std::vector<Point>(points));
     }
 }
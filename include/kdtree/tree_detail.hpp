@@ -1,95 +1,482 @@
 ﻿#pragma once
 
-#include "node.hpp"
+#include "node_storage.hpp"
+#include "parallel.hpp"
 #include "point_traits.hpp"
+#include "search_stats.hpp"
+#include "simd.hpp"
 
 #include <algorithm>
+#include <array>
+#include <cstdint>
+#include <future>
+#include <iterator>
+#include <limits>
 #include <ostream>
 #include <vector>
 #include <numeric>
 #include <ranges>
+#include <stdexcept>
 #include <type_traits>
+#include <utility>
 
 namespace kdtree::detail {
 
-    template<class Range>
-    concept index_range =
-        std::ranges::sized_range<Range> &&
-        std::convertible_to<std::ranges::range_value_t<Range>, size_t>;
+    // Dimension passed through the algorithms. It is an int for points such
+    // as std::vector and static_kdim<N> for points with point_kdim_v, which
+    // turns every loop over axes and every axis wrap-around into constants.
+    template<size_t N>
+    using static_kdim = std::integral_constant<size_t, N>;
 
-    template<points_range Points, index_range Index>
-    static void argsort(Points& points, Index& indices, const auto axis) {
+    template<class T>
+    struct is_static_kdim : std::false_type {};
 
-        const auto length = std::ranges::size(indices);
+    template<size_t N>
+    struct is_static_kdim<static_kdim<N>> : std::true_type {};
 
-        if (length <= 1) return;
+    template<class T>
+    constexpr bool is_static_kdim_v = is_static_kdim<std::remove_cvref_t<T>>::value;
 
-        auto begin = std::ranges::begin(indices);
-        auto mid = begin + length / 2;
-        auto end = std::ranges::end(indices);
+    template<class Point>
+    struct kdim_type {
+        using type = int;
+    };
 
-        std::nth_element(begin, mid, end,
-            [&points, &axis](auto a, auto b) { return points[a][axis] < points[b][axis]; });
+    template<static_kdim_point Point>
+    struct kdim_type<Point> {
+        using type = static_kdim<point_kdim_v<Point>>;
+    };
+
+    template<class Point>
+    using kdim_type_t = typename kdim_type<Point>::type;
+
+    // Throws std::invalid_argument for points with point_kdim_v if kdim is
+    // neither 0 nor their dimension.
+    template<class Point>
+    kdim_type_t<Point> make_kdim(const int kdim) {
+        if constexpr (is_static_kdim_v<kdim_type_t<Point>>) {
+            if (kdim != 0 && size_t(kdim) != kdim_type_t<Point>::value) {
+                throw std::invalid_argument("kdtree: kdim differs from the dimension of the point type");
+            }
+            return {};
+        }
+        else {
+            return kdim;
+        }
+    }
+
+    // Calls fn with the dimension as static_kdim<N> if it is one of the
+    // common dimensions below, so a run-time dimension gets the same
+    // specialized code as point types with point_kdim_v, and as is otherwise.
+    template<class Fn>
+    decltype(auto) dispatch_kdim(const auto& kdim, Fn&& fn) {
+        if constexpr (is_static_kdim_v<decltype(kdim)>) {
+            return fn(kdim);
+        }
+        else {
+            switch (kdim) {
+            case 2: return fn(static_kdim<2>{});
+            case 3: return fn(static_kdim<3>{});
+            case 4: return fn(static_kdim<4>{});
+            case 6: return fn(static_kdim<6>{});
+            case 8: return fn(static_kdim<8>{});
+            case 16: return fn(static_kdim<16>{});
+            case 32: return fn(static_kdim<32>{});
+            case 64: return fn(static_kdim<64>{});
+            case 128: return fn(static_kdim<128>{});
+            default: return fn(kdim);
+            }
+        }
     }
 
-    template<points_range Points, index_range Index>
-    auto build_r(Points& points, Index& indices, const auto& kdim, const auto& axis) {
+    inline size_t next_axis(const size_t axis, const auto& kdim) {
+        return axis + 1 == size_t(kdim) ? 0 : axis + 1;
+    }
 
-        using point_t = points_range_point_t<Points>;
+    // Subtrees of up to leaf_size points are not split any further, their
+    // records form a chain of right children that is scanned linearly.
+    template<point Point>
+    void make_bucket(node_storage<Point>& storage, const size_t begin, const size_t end) {
+        for (auto i = begin; i < end; ++i) {
+            storage.nodes[i].right = i + 1;
+        }
+    }
+
+    // Smallest subtree that is worth building on a separate thread.
+    constexpr size_t parallel_build_cutoff = size_t(1) << 14;
+
+    // Axis and position of the node point of the subtree [begin, end)
+    // after sorting it along that axis.
+    struct split {
+        size_t axis;
+        size_t mid;
+    };
+
+    template<point Point>
+    auto axis_bounds(const node_storage<Point>& storage, const size_t begin, const size_t end, const size_t axis) {
+        const auto [lo, hi] = std::ranges::minmax(
+            std::ranges::subrange(storage.points.begin() + begin, storage.points.begin() + end),
+            std::less(), [axis](const Point& p) { return p[axis]; });
+        return std::make_pair(lo[axis], hi[axis]);
+    }
+
+    template<point Point>
+    split choose_split(
+        node_storage<Point>& storage,
+        const size_t begin,
+        const size_t end,
+        const auto& kdim,
+        const size_t axis,
+        const split_rule rule) {
+
+        const auto median = begin + (end - begin) / 2;
+
+        if (rule == split_rule::round_robin) {
+            return { axis, median };
+        }
+
+        // axis of the largest extent of the points
+        size_t widest = 0;
+        auto widest_lo = point_distance_t<Point>(0);
+        auto widest_hi = point_distance_t<Point>(0);
+
+        for (size_t a = 0; a < size_t(kdim); ++a) {
+            const auto [lo, hi] = axis_bounds(storage, begin, end, a);
+            if (a == 0 || hi - lo > widest_hi - widest_lo) {
+                widest = a;
+                widest_lo = lo;
+                widest_hi = hi;
+            }
+        }
+
+        if (rule == split_rule::widest_spread || !(widest_lo < widest_hi)) {
+            return { widest, median };
+        }
+
+        // sliding midpoint: cut the extent in half, the node is the first
+        // point at or past the cut, or the last point if there is none
+        const auto cut = widest_lo + (widest_hi - widest_lo) / 2;
+        const auto below = size_t(std::ranges::count_if(
+            storage.points.begin() + begin, storage.points.begin() + end,
+            [widest, cut](const Point& p) { return p[widest] < cut; }));
+
+        return { widest, std::min(begin + below, end - 1) };
+    }
+
+    // Builds the subtrees in [begin, end) with an explicit stack. With
+    // threads > 1 the two halves of a large subtree are built concurrently:
+    // they own disjoint ranges of points and records, and the tree is the
+    // same as a sequential one.
+    template<point Point>
+    void build_subtree(
+        node_storage<Point>& storage,
+        const size_t begin,
+        const size_t end,
+        const auto& kdim,
+        const size_t axis,
+        const build_options& options,
+        const size_t threads = 1) {
+
+        struct pending_range {
+            size_t begin;
+            size_t end;
+            size_t axis;
+        };
+
+        const auto leaf_size = std::max<size_t>(options.leaf_size, 1);
+        auto& points = storage.points;
+        const auto points_begin = points.begin();
+
+        std::vector<pending_range> stack{ { begin, end, axis } };
+
+        while (!stack.empty()) {
+            const auto range = stack.back();
+            stack.pop_back();
+
+            if (range.end - range.begin <= leaf_size) {
+                make_bucket(storage, range.begin, range.end);
+                continue;
+            }
+
+            const auto [split_axis, mid] = choose_split(storage, range.begin, range.end, kdim, range.axis, options.split);
+
+            std::nth_element(points_begin + range.begin, points_begin + mid, points_begin + range.end,
+                [split_axis](const Point& a, const Point& b) { return a[split_axis] < b[split_axis]; });
+
+            // pre-order: node point goes first, followed by the left subtree
+            std::swap(points[range.begin], points[mid]);
+            storage.nodes[range.begin].right = mid + 1;
+            storage.nodes[range.begin].axis = std::uint32_t(split_axis);
 
-        const auto indices_length = std::ranges::size(indices);
+            const auto axis_next = next_axis(split_axis, kdim);
 
-        if (indices_length == 0) {
-            return make_leaf<point_t>();
+            if (threads > 1 && range.end - range.begin >= parallel_build_cutoff) {
+                const auto threads_l = threads / 2;
+                const auto threads_r = threads - threads_l;
+
+                auto left = std::async(std::launch::async, [&, range, mid, axis_next, threads_l]() {
+                    build_subtree(storage, range.begin + 1, mid + 1, kdim, axis_next, options, threads_l);
+                });
+
+                build_subtree(storage, mid + 1, range.end, kdim, axis_next, options, threads_r);
+                left.get();
+                continue;
+            }
+
+            if (mid + 1 < range.end) {
+                stack.push_back({ mid + 1, range.end, axis_next });
+            }
+
+            if (mid > range.begin) {
+                stack.push_back({ range.begin + 1, mid + 1, axis_next });
+            }
         }
+    }
 
-        argsort(points, indices, axis);
+    // State of the presorted build. orders[a] lists point ids sorted by
+    // axis a, ties broken by id. Every subtree owns the same range of all
+    // orders, so a split only has to partition each range stably into the
+    // ids of the left subtree and of the right one, which is a sequential
+    // pass. side[id] tells which part a point goes to.
+    template<point Point>
+    struct presorted_build {
+        std::vector<Point> source;
+        std::vector<std::vector<size_t>> orders;
+        std::vector<std::uint8_t> side;
+
+        static constexpr std::uint8_t left = 0;
+        static constexpr std::uint8_t right = 1;
+        static constexpr std::uint8_t node = 2;
 
-        const auto indices_begin = std::ranges::begin(indices);
-        const auto indices_mid = indices_begin + indices_length / 2;
-        const auto indices_end = std::ranges::end(indices);
+        auto coord(const size_t axis, const size_t i) const {
+            return source[orders[axis][i]][axis];
+        }
+    };
 
-        const auto indices_begin_l = indices_begin;
-        const auto indices_end_l = indices_mid;
-        const auto indices_l = std::ranges::subrange(indices_begin_l, indices_end_l);
-        const auto length_l = std::ranges::size(indices_l);
+    template<point Point>
+    presorted_build<Point> make_presorted_build(std::vector<Point> source, const auto& kdim) {
+        presorted_build<Point> state;
+        state.source = std::move(source);
+        state.side.resize(state.source.size());
 
-        const auto indices_begin_r = indices_mid + 1;
-        const auto indices_end_r = indices_end;
-        const auto indices_r = std::ranges::subrange(indices_begin_r, indices_end_r);
-        const auto length_r = std::ranges::size(indices_r);
+        std::vector<std::pair<point_distance_t<Point>, size_t>> keys(state.source.size());
 
-        const auto next_axis = (axis + 1) % kdim;
+        for (size_t axis = 0; axis < size_t(kdim); ++axis) {
+            for (size_t id = 0; id < keys.size(); ++id) {
+                keys[id] = { state.source[id][axis], id };
+            }
+            std::ranges::sort(keys);
 
-        typename node<point_t>::container_type left;
-        if (length_l > 0 && kdim > 0) {
-            left = build_r(points, indices_l, kdim, next_axis);
+            auto& order = state.orders.emplace_back(keys.size());
+            std::ranges::transform(keys, order.begin(), [](const auto& key) { return key.second; });
         }
-        else {
-            left = make_leaf<point_t>();
+
+        return state;
+    }
+
+    // Same rules as choose_split, but the extent of an axis is read off the
+    // ends of its order and the sliding midpoint is found by bisection.
+    template<point Point>
+    split choose_presorted_split(
+        const presorted_build<Point>& state,
+        const size_t begin,
+        const size_t end,
+        const auto& kdim,
+        const size_t axis,
+        const split_rule rule) {
+
+        const auto median = (end - begin) / 2;
+
+        if (rule == split_rule::round_robin) {
+            return { axis, median };
         }
 
-        typename node<point_t>::container_type right;
-        if (length_r > 0 && kdim > 0) {
-            right = build_r(points, indices_r, kdim, next_axis);
+        size_t widest = 0;
+        for (size_t a = 1; a < size_t(kdim); ++a) {
+            if (state.coord(a, end - 1) - state.coord(a, begin) > state.coord(widest, end - 1) - state.coord(widest, begin)) {
+                widest = a;
+            }
         }
-        else {
-            right = make_leaf<point_t>();
+
+        const auto lo = state.coord(widest, begin);
+        const auto hi = state.coord(widest, end - 1);
+
+        if (rule == split_rule::widest_spread || !(lo < hi)) {
+            return { widest, median };
         }
 
-        return make_node<point_t>(points[*indices_mid], std::move(left), std::move(right));
+        const auto cut = lo + (hi - lo) / 2;
+        const auto& order = state.orders[widest];
+        const auto below = size_t(std::partition_point(order.begin() + begin, order.begin() + end,
+            [&state, widest, cut](size_t id) { return state.source[id][widest] < cut; }) - (order.begin() + begin));
+
+        return { widest, std::min(below, end - begin - 1) };
+    }
+
+    // Builds the subtree whose ids are [begin, end) of every order into the
+    // records starting at out. Like build_subtree, it hands the two halves
+    // of large subtrees to separate threads.
+    template<point Point>
+    void build_presorted_subtree(
+        node_storage<Point>& storage,
+        presorted_build<Point>& state,
+        const size_t begin,
+        const size_t end,
+        const size_t out,
+        const auto& kdim,
+        const size_t axis,
+        const build_options& options,
+        const size_t threads = 1) {
+
+        struct pending_range {
+            size_t begin;
+            size_t end;
+            size_t out;
+            size_t axis;
+        };
+
+        using state_t = presorted_build<Point>;
+
+        const auto leaf_size = std::max<size_t>(options.leaf_size, 1);
+
+        std::vector<size_t> right_ids;
+        std::vector<pending_range> stack{ { begin, end, out, axis } };
+
+        while (!stack.empty()) {
+            const auto range = stack.back();
+            stack.pop_back();
+
+            const auto length = range.end - range.begin;
+
+            if (length <= leaf_size) {
+                for (size_t i = 0; i < length; ++i) {
+                    storage.points[range.out + i] = std::move(state.source[state.orders[0][range.begin + i]]);
+                }
+                make_bucket(storage, range.out, range.out + length);
+                continue;
+            }
+
+            const auto [split_axis, mid] = choose_presorted_split(state, range.begin, range.end, kdim, range.axis, options.split);
+
+            const auto& split_order = state.orders[split_axis];
+            const auto node_id = split_order[range.begin + mid];
+
+            for (auto i = range.begin; i < range.end; ++i) {
+                state.side[split_order[i]] = state_t::right;
+            }
+            for (auto i = range.begin; i < range.begin + mid; ++i) {
+                state.side[split_order[i]] = state_t::left;
+            }
+            state.side[node_id] = state_t::node;
+
+            // stable partition of every order: left ids, then right ids,
+            // the node id is dropped
+            for (auto& order : state.orders) {
+                right_ids.clear();
+                auto w = range.begin;
+                for (auto i = range.begin; i < range.end; ++i) {
+                    const auto id = order[i];
+                    const auto side = state.side[id];
+                    if (side == state_t::left) {
+                        order[w++] = id;
+                    }
+                    else if (side == state_t::right) {
+                        right_ids.push_back(id);
+                    }
+                }
+                std::ranges::copy(right_ids, order.begin() + w);
+            }
+
+            storage.points[range.out] = std::move(state.source[node_id]);
+            storage.nodes[range.out] = { range.out + 1 + mid, std::uint32_t(split_axis) };
+
+            const auto axis_next = next_axis(split_axis, kdim);
+            const pending_range left{ range.begin, range.begin + mid, range.out + 1, axis_next };
+            const pending_range right{ range.begin + mid, range.end - 1, range.out + 1 + mid, axis_next };
+
+            if (threads > 1 && length >= parallel_build_cutoff) {
+                const auto threads_l = threads / 2;
+                const auto threads_r = threads - threads_l;
+
+                auto left_task = std::async(std::launch::async, [&, left, threads_l]() {
+                    build_presorted_subtree(storage, state, left.begin, left.end, left.out, kdim, left.axis, options, threads_l);
+                });
+
+                build_presorted_subtree(storage, state, right.begin, right.end, right.out, kdim, right.axis, options, threads_r);
+                left_task.get();
+                continue;
+            }
+
+            if (right.begin < right.end) {
+                stack.push_back(right);
+            }
+
+            if (left.begin < left.end) {
+                stack.push_back(left);
+            }
+        }
+    }
+
+    // Builds the tree from points taken over by value: they are reordered
+    // in place, so the only allocations are the node records (and the
+    // coordinate copies of the layout).
+    template<point Point>
+    node_storage<Point> build(std::vector<Point>&& points, int kdim, const build_options& options = {}) {
+
+        using point_t = Point;
+
+        node_storage<point_t> storage;
+
+        const auto length = points.size();
+        const auto kdim_resolved = make_kdim<point_t>(kdim);
+
+        if (length == 0 || kdim <= 0) {
+            return storage;
+        }
+
+        storage.points = std::move(points);
+        storage.nodes.resize(length);
+
+        dispatch_kdim(kdim_resolved, [&](const auto& dim) {
+            if (options.method == build_method::presort) {
+                auto state = make_presorted_build(std::move(storage.points), dim);
+                storage.points.resize(length);
+                build_presorted_subtree(storage, state, 0, length, 0, dim, 0, options, resolve_threads(options.threads));
+            }
+            else {
+                build_subtree(storage, 0, length, dim, 0, options, resolve_threads(options.threads));
+            }
+        });
+
+        if (options.layout == coordinate_layout::soa) {
+            storage.coords = make_coordinates(storage.points, size_t(kdim_resolved));
+        }
+
+        if constexpr (packed_point<point_t>) {
+            storage.packed = make_packed(storage.points, size_t(kdim_resolved));
+        }
+
+        return storage;
     }
 
     template<points_range Points>
-    auto build(const Points& points, int kdim) {
-        std::vector<size_t> indices(std::ranges::size(points));
-        std::iota(indices.begin(), indices.end(), 0);
-        auto root = build_r(points, indices, kdim, 0);
-        return root;
+    auto build(const Points& points, int kdim, const build_options& options = {}) {
+
+        using point_t = points_range_point_t<Points>;
+
+        if (kdim <= 0) {
+            return node_storage<point_t>{};
+        }
+
+        std::vector<point_t> copy;
+        copy.reserve(std::ranges::size(points));
+        std::ranges::copy(points, std::back_inserter(copy));
+
+        return build(std::move(copy), kdim, options);
     }
 
     template<point Point>
-    using find_result_t = std::pair<node<Point> const*, point_distance_t<Point>>;
+    using find_result_t = std::pair<size_t, point_distance_t<Point>>;
 
     template<point Point>
     static find_result_t<Point> min(
@@ -98,147 +485,710 @@ namespace kdtree::detail {
         return a.second < b.second ? a : b;
     }
 
-    template<point Point>
-    auto dist_sqr(const Point& a, const Point& b, const auto kdim) {
+    // Coordinates of node i: a row of the packed copy for packed_point
+    // types, the point itself otherwise.
+    template<class Storage>
+    decltype(auto) point_at(const Storage& storage, const size_t i) {
+        if constexpr (packed_point<typename Storage::point_type>) {
+            return storage.packed.row(i);
+        }
+        else {
+            return (storage.points[i]);
+        }
+    }
+
+    template<class Point>
+    const auto* point_data(const Point& p) {
+        if constexpr (std::is_pointer_v<Point>) {
+            return p;
+        }
+        else {
+            return std::ranges::data(p);
+        }
+    }
 
-        auto dist{ point_distance_t<Point>(0) };
+    // b is either a point of the same type as a or its packed row.
+    template<point Point, class Other>
+    auto dist_sqr(const Point& a, const Other& b, const auto kdim) {
+
+        using distance_t = point_distance_t<Point>;
 
-        for (auto i = 0; i < kdim; ++i) {
-            auto ai = a[i];
-            auto bi = b[i];
-            auto di = ai - bi;
-            dist += di * di;
+        if constexpr (contiguous_point<Point>) {
+            if (size_t(kdim) >= dist_sqr_kernel_min_kdim) {
+                return dist_sqr_kernel<distance_t>()(std::ranges::data(a), point_data(b), kdim);
+            }
         }
 
-        return dist;
+        if constexpr (is_static_kdim_v<decltype(kdim)>) {
+            // unrolled, sums up axes in the same order as the loop below
+            return [&a, &b]<size_t... I>(std::index_sequence<I...>) {
+                auto dist{ distance_t(0) };
+                ((dist += (a[I] - b[I]) * (a[I] - b[I])), ...);
+                return dist;
+            }(std::make_index_sequence<decltype(kdim)::value>());
+        }
+        else {
+            auto dist{ distance_t(0) };
+
+            for (size_t i = 0; i < size_t(kdim); ++i) {
+                auto ai = a[i];
+                auto bi = b[i];
+                auto di = ai - bi;
+                dist += di * di;
+            }
+
+            return dist;
+        }
+    }
+
+    // Range of node records occupied by a subtree, the first one is its root.
+    struct subtree {
+        size_t node;
+        size_t end;
+    };
+
+    // Stack of pending subtrees for the iterative searches. The first N
+    // entries live inline, which is enough for trees split at the median;
+    // sliding midpoint splits are not bounded by log n, so such trees and
+    // deep hand-made ones may spill over to the heap.
+    template<class T, size_t N = 64>
+    class traversal_stack {
+    public:
+        bool empty() const {
+            return size_ == 0;
+        }
+
+        size_t size() const {
+            return size_;
+        }
+
+        void push(const T& value) {
+            if (size_ < N) {
+                inline_[size_] = value;
+            }
+            else {
+                overflow_.push_back(value);
+            }
+            ++size_;
+        }
+
+        T pop() {
+            --size_;
+            if (size_ < N) {
+                return inline_[size_];
+            }
+            const auto value = overflow_.back();
+            overflow_.pop_back();
+            return value;
+        }
+
+    private:
+        std::array<T, N> inline_;
+        std::vector<T> overflow_;
+        size_t size_ = 0;
+    };
+
+    // Subtree waiting on the stack, bound is the squared distance from the
+    // key to the splitting plane that separates it from the key.
+    template<point Point>
+    struct pending_subtree {
+        subtree range;
+        point_distance_t<Point> bound;
+    };
+
+    template<class Storage>
+    bool is_erased(const Storage& storage, const size_t index) {
+        return !storage.dead.empty() && storage.dead[index];
+    }
+
+    // false only for a subtree whose points are all erased
+    template<class Storage>
+    bool has_live(const Storage& storage, const subtree& range) {
+        return storage.live.empty() || storage.live[range.node] > 0;
     }
 
+    template<class Storage>
+    constexpr size_t live_size(const Storage& storage) {
+        return storage.live.empty() ? storage.nodes.size() : storage.live[0];
+    }
+
+    // Marks points[index] as erased and takes it off the live counts of
+    // the records on the path from the root to it.
     template<point Point>
-    find_result_t<Point> find_nearest_r(
-        const node<Point>* root,
+    void erase(node_storage<Point>& storage, const size_t index) {
+
+        const auto length = storage.nodes.size();
+
+        if (storage.live.empty()) {
+            storage.dead.assign(length, 0);
+            storage.live.resize(length);
+
+            std::vector<subtree> stack{ { 0, length } };
+            while (!stack.empty()) {
+                const auto [node, end] = stack.back();
+                stack.pop_back();
+
+                storage.live[node] = end - node;
+
+                const auto right = storage.nodes[node].right;
+                if (node + 1 < right) {
+                    stack.push_back({ node + 1, right });
+                }
+                if (right < end) {
+                    stack.push_back({ right, end });
+                }
+            }
+        }
+
+        storage.dead[index] = 1;
+
+        for (size_t node = 0; ; ) {
+            --storage.live[node];
+            if (node == index) {
+                break;
+            }
+            const auto right = storage.nodes[node].right;
+            node = index < right ? node + 1 : right;
+        }
+    }
+
+    // Computes distances to a block of up to dist_block_size consecutive
+    // points from the structure-of-arrays coordinates with the best
+    // dist_block_kernel for this CPU and returns the smallest of them.
+    template<point Point, class Storage>
+    auto dist_sqr_block(
+        const Storage& storage,
+        const size_t first,
+        const size_t count,
+        const Point& key,
+        const auto& kdim,
+        dist_block_t<Point>& dists) {
+
+        const auto& coords = storage.coords;
+        return dist_block_kernel<Point>()(coords.values.data() + first, coords.stride, key, kdim, count, dists.data());
+    }
+
+    template<point Point, class Storage>
+    find_result_t<Point> scan_nearest(
+        const Storage& storage,
+        const subtree& bucket,
         const Point& key,
-        const auto& axis,
         const auto& kdim,
         const find_result_t<Point>& best) {
 
-        const auto dist = dist_sqr(key, root->value(), kdim);
+        auto best_upd = best;
 
-        const auto& root_at_axis = root->value()[axis];
-        const auto& key_at_axis = key[axis];
-        const auto delta = root_at_axis - key_at_axis;
-        const auto delta2 = delta * delta;
+        if (!storage.coords.empty()) {
+            alignas(coordinate_storage<point_distance_t<Point>>::alignment) dist_block_t<Point> dists;
 
-        auto best_upd = min(best, std::make_pair(root, dist));
+            for (auto first = bucket.node; first < bucket.end; first += dist_block_size) {
+                const auto count = std::min(dist_block_size, bucket.end - first);
 
-        auto [selected, other] = delta > 0
-            ? std::make_pair(root->left().get(), root->right().get())
-            : std::make_pair(root->right().get(), root->left().get());
+                // most blocks cannot improve the result, skip the per-point pass
+                if (dist_sqr_block(storage, first, count, key, kdim, dists) > best_upd.second) {
+                    continue;
+                }
 
-        const auto next_axis = (axis + 1) % kdim;
+                for (size_t j = 0; j < count; ++j) {
+                    if (!is_erased(storage, first + j)) {
+                        best_upd = min<Point>(best_upd, std::make_pair(first + j, dists[j]));
+                    }
+                }
+            }
 
-        auto further_1 = selected
-            ? min(best_upd, find_nearest_r(selected, key, next_axis, kdim, best_upd))
-            : best_upd;
+            return best_upd;
+        }
 
-        auto further_2 = other && delta2 < further_1.second
-            ? min(further_1, find_nearest_r(other, key, next_axis, kdim, further_1))
-            : further_1;
+        for (auto i = bucket.node; i < bucket.end; ++i) {
+            if (is_erased(storage, i)) {
+                continue;
+            }
+            const auto dist = dist_sqr(key, point_at(storage, i), kdim);
+            best_upd = min<Point>(best_upd, std::make_pair(i, dist));
+        }
 
-        return further_2;
+        return best_upd;
     }
 
+    // Approximate search visits the far side of a split only if it may hold
+    // a point closer than best / (1 + eps), so the result is at most (1 + eps)
+    // times further than the true nearest point. Pruning compares squared
+    // distances, so the plane distance is scaled by (1 + eps)^2.
     template<point Point>
+    using prune_scale_t = std::conditional_t<
+        std::floating_point<point_distance_t<Point>>, point_distance_t<Point>, double>;
+
+    template<point Point>
+    prune_scale_t<Point> make_prune_scale(const double eps) {
+        const auto scale = 1.0 + std::max(eps, 0.0);
+        return prune_scale_t<Point>(scale * scale);
+    }
+
+    // Depth-first search with a single running best. The closer child of a
+    // node is entered right away and the other one is pushed to the stack,
+    // to be pruned when it is popped if the best result has improved enough
+    // by then. The work done is reported to stats, see search_stats.
+    template<point Point, class Storage, class Stats = no_search_stats>
+    find_result_t<Point> find_nearest_iter(
+        const Storage& storage,
+        const Point& key,
+        const auto& kdim,
+        const size_t leaf_size,
+        const prune_scale_t<Point>& prune_scale,
+        find_result_t<Point> best,
+        Stats&& stats = {}) {
+
+        traversal_stack<pending_subtree<Point>> stack;
+        stack.push({ { 0, storage.nodes.size() }, 0 });
+
+        while (!stack.empty()) {
+            auto [root, bound] = stack.pop();
+
+            if (!(bound * prune_scale < best.second) || !has_live(storage, root)) {
+                continue;
+            }
+            if (root.node != 0) {
+                stats.descend_far();
+            }
+
+            while (true) {
+                if (root.end - root.node <= leaf_size) {
+                    stats.scan_leaf(root.end - root.node);
+                    best = scan_nearest(storage, root, key, kdim, best);
+                    break;
+                }
+
+                stats.visit_node();
+                const auto& record = storage.nodes[root.node];
+                const auto& value = point_at(storage, root.node);
+                const auto dist = dist_sqr(key, value, kdim);
+
+                const auto axis = record.axis;
+                const auto delta = value[axis] - key[axis];
+                const auto delta2 = delta * delta;
+
+                if (!is_erased(storage, root.node)) {
+                    best = min<Point>(best, std::make_pair(root.node, dist));
+                }
+
+                const subtree left{ root.node + 1, record.right };
+                const subtree right{ record.right, root.end };
+
+                const auto& [selected, other] = delta > 0
+                    ? std::make_pair(left, right)
+                    : std::make_pair(right, left);
+
+                if (other.node != other.end) {
+                    stack.push({ other, delta2 });
+                    stats.stack_depth(stack.size());
+                }
+
+                if (selected.node == selected.end || !has_live(storage, selected)) {
+                    break;
+                }
+
+                root = selected;
+            }
+        }
+
+        return best;
+    }
+
+    // Index and squared distance of the nearest point, the distance is
+    // the largest one representable for an empty tree.
+    template<point Point, class Storage, class Stats = no_search_stats>
+    find_result_t<Point> find_nearest_result(
+        const Storage& storage,
+        const Point& key,
+        const auto& kdim,
+        const size_t leaf_size = 1,
+        const double eps = 0,
+        Stats&& stats = {}) {
+
+        using distance_t = point_distance_t<Point>;
+
+        const find_result_t<Point> worst{ 0, std::numeric_limits<distance_t>::max() };
+
+        if (live_size(storage) == 0) {
+            return worst;
+        }
+
+        return dispatch_kdim(kdim, [&](const auto& dim) {
+            return find_nearest_iter(storage, key, dim, leaf_size, make_prune_scale<Point>(eps), worst, stats);
+        });
+    }
+
+    template<point Point, class Storage>
     Point find_nearest(
-        const node_container_t<Point>& root,
+        const Storage& storage,
         const Point& key,
-        const auto& kdim) {
+        const auto& kdim,
+        const size_t leaf_size = 1,
+        const double eps = 0) {
 
-        if (!root) {
+        if (live_size(storage) == 0) {
             return Point{};
         }
 
-        using distance_t = point_distance_t<Point>;
-        
-        const find_result_t<Point> worst{ nullptr, std::numeric_limits<distance_t>::max() };
-        
-        return find_nearest_r(root.get(), key, 0, kdim, worst).first->value();
+        return storage.points[find_nearest_result(storage, key, kdim, leaf_size, eps).first];
     }
 
     template<point Point>
     using find_result_vector_t = std::vector<find_result_t<Point>>;
 
+    // Fixed-capacity max-heap of the best candidates found so far. The worst
+    // accepted candidate is on top, so a new one is accepted or rejected in
+    // O(1) and replaces it in O(log k). Results are sorted once at the end.
     template<point Point>
-    static void append_result(
-        find_result_vector_t<Point>& results,
-        const find_result_t<Point>& value,
-        const auto& num) {
+    class result_heap {
+    public:
+        using distance_type = point_distance_t<Point>;
 
-        if (num == 0) return;
+        void reset(size_t capacity) {
+            capacity_ = capacity;
+            offset_ = 0;
+            items_.clear();
+            items_.reserve(capacity);
+        }
 
-        using distance_t = point_distance_t<Point>;
+        // Added to the index of every candidate pushed from now on, so that
+        // several trees can share one heap with disjoint ranges of indices.
+        void set_offset(size_t offset) {
+            offset_ = offset;
+        }
 
-        const auto u = std::ranges::upper_bound(
-            results, value.second, std::less(), &find_result_t<Point>::second);
+        size_t capacity() const {
+            return capacity_;
+        }
 
-        if (results.size() < num) {
-            results.insert(u, value);
+        size_t size() const {
+            return items_.size();
         }
-        else if (u != results.end()) {
-            results.insert(u, value);
-            results.pop_back();
+
+        bool full() const {
+            return items_.size() == capacity_;
+        }
+
+        // distance of the worst accepted candidate, heap must not be empty
+        distance_type worst() const {
+            return items_.front().second;
+        }
+
+        // true if a candidate at this distance would be accepted
+        bool accepts(const distance_type& dist) const {
+            return !full() || dist < worst();
+        }
+
+        void push(const find_result_t<Point>& value) {
+            if (!full()) {
+                items_.emplace_back(value.first + offset_, value.second);
+                std::ranges::push_heap(items_, less);
+            }
+            else if (capacity_ > 0 && value.second < worst()) {
+                std::ranges::pop_heap(items_, less);
+                items_.back() = { value.first + offset_, value.second };
+                std::ranges::push_heap(items_, less);
+            }
+        }
+
+        // Sorts the candidates by distance, then by node index, and leaves
+        // the heap invalid until the next reset.
+        const find_result_vector_t<Point>& sort() {
+            std::ranges::sort(items_, less);
+            return items_;
         }
-    }
 
+    private:
+        static bool less(const find_result_t<Point>& a, const find_result_t<Point>& b) {
+            return a.second < b.second || (a.second == b.second && a.first < b.first);
+        }
+
+        find_result_vector_t<Point> items_;
+        size_t capacity_ = 0;
+        size_t offset_ = 0;
+    };
+
+    // Heap reused by the queries of the calling thread, so that queries
+    // which write to caller-supplied output do not allocate once it has
+    // grown to the largest num asked for.
     template<point Point>
-    void find_nearest_n_r(
-        const node<Point>* root,
+    result_heap<Point>& thread_result_heap() {
+        thread_local result_heap<Point> results;
+        return results;
+    }
+
+    template<point Point, class Storage>
+    void scan_nearest_n(
+        const Storage& storage,
+        const subtree& bucket,
         const Point& key,
-        const auto& axis,
         const auto& kdim,
-        const auto& num,
-        find_result_vector_t<Point>& results) {
+        result_heap<Point>& results) {
+
+        if (!storage.coords.empty()) {
+            alignas(coordinate_storage<point_distance_t<Point>>::alignment) dist_block_t<Point> dists;
+
+            for (auto first = bucket.node; first < bucket.end; first += dist_block_size) {
+                const auto count = std::min(dist_block_size, bucket.end - first);
+                const auto block_min = dist_sqr_block(storage, first, count, key, kdim, dists);
+
+                if (!results.accepts(block_min)) {
+                    continue;
+                }
+
+                for (size_t j = 0; j < count; ++j) {
+                    if (!is_erased(storage, first + j)) {
+                        results.push(std::make_pair(first + j, dists[j]));
+                    }
+                }
+            }
+
+            return;
+        }
+
+        for (auto i = bucket.node; i < bucket.end; ++i) {
+            if (is_erased(storage, i)) {
+                continue;
+            }
+            const auto dist = dist_sqr(key, point_at(storage, i), kdim);
+            results.push(std::make_pair(i, dist));
+        }
+    }
+
+    template<point Point, class Storage, class Stats = no_search_stats>
+    void find_nearest_n_iter(
+        const Storage& storage,
+        const Point& key,
+        const auto& kdim,
+        const size_t leaf_size,
+        const prune_scale_t<Point>& prune_scale,
+        result_heap<Point>& results,
+        Stats&& stats = {}) {
+
+        traversal_stack<pending_subtree<Point>> stack;
+        stack.push({ { 0, storage.nodes.size() }, 0 });
+
+        while (!stack.empty()) {
+            auto [root, bound] = stack.pop();
+
+            if ((results.full() && !(bound * prune_scale < results.worst())) || !has_live(storage, root)) {
+                continue;
+            }
+            if (root.node != 0) {
+                stats.descend_far();
+            }
+
+            while (true) {
+                if (root.end - root.node <= leaf_size) {
+                    stats.scan_leaf(root.end - root.node);
+                    scan_nearest_n(storage, root, key, kdim, results);
+                    break;
+                }
 
-        const auto dist = dist_sqr(key, root->value(), kdim);
+                stats.visit_node();
+                const auto& record = storage.nodes[root.node];
+                const auto& value = point_at(storage, root.node);
+                const auto dist = dist_sqr(key, value, kdim);
 
-        const auto& root_at_axis = root->value()[axis];
-        const auto& key_at_axis = key[axis];
-        const auto delta = root_at_axis - key_at_axis;
-        const auto delta2 = delta * delta;
+                const auto axis = record.axis;
+                const auto delta = value[axis] - key[axis];
+                const auto delta2 = delta * delta;
 
-        append_result(results, std::make_pair(root, dist), num);
+                if (!is_erased(storage, root.node)) {
+                    results.push(std::make_pair(root.node, dist));
+                }
 
-        auto [selected, other] = delta > 0
-            ? std::make_pair(root->left().get(), root->right().get())
-            : std::make_pair(root->right().get(), root->left().get());
+                const subtree left{ root.node + 1, record.right };
+                const subtree right{ record.right, root.end };
 
-        const auto next_axis = (axis + 1) % kdim;
+                const auto& [selected, other] = delta > 0
+                    ? std::make_pair(left, right)
+                    : std::make_pair(right, left);
 
-        if (selected) {
-            find_nearest_n_r(selected, key, next_axis, kdim, num, results);
+                if (other.node != other.end) {
+                    stack.push({ other, delta2 });
+                    stats.stack_depth(stack.size());
+                }
+
+                if (selected.node == selected.end || !has_live(storage, selected)) {
+                    break;
+                }
+
+                root = selected;
+            }
         }
+    }
 
-        if (other && (results.size() < num || delta2 < results[results.size() - 1].second)) {
-            find_nearest_n_r(other, key, next_axis, kdim, num, results);
+    // Finds up to num nearest (index, distance) pairs in order of distance.
+    // The heap is reset, so one heap can be reused for many queries.
+    template<point Point, class Storage, class Stats = no_search_stats>
+    const find_result_vector_t<Point>& find_nearest_n(
+        const Storage& storage,
+        const Point& key,
+        const auto& kdim,
+        const auto& num,
+        const size_t leaf_size,
+        const double eps,
+        result_heap<Point>& results,
+        Stats&& stats = {}) {
+
+        results.reset(std::min<size_t>(num, live_size(storage)));
+
+        if (results.capacity() > 0) {
+            dispatch_kdim(kdim, [&](const auto& dim) {
+                find_nearest_n_iter(storage, key, dim, leaf_size, make_prune_scale<Point>(eps), results, stats);
+            });
         }
+
+        return results.sort();
     }
-        
-    template<point Point>
+
+    template<point Point, class Storage>
+    void results_to_points(
+        const Storage& storage,
+        const find_result_vector_t<Point>& results,
+        std::vector<Point>& points) {
+
+        points.resize(results.size());
+        std::ranges::transform(
+            results, points.begin(),
+            [&storage](const auto& res) { return storage.points[res.first]; });
+    }
+
+    template<point Point, class Storage>
     std::vector<Point> find_nearest_n(
-        const node_container_t<Point>& root,
+        const Storage& storage,
         const Point& key,
         const auto& kdim,
-        const auto& num) {
+        const auto& num,
+        const size_t leaf_size = 1,
+        const double eps = 0) {
 
-        if (!root || num == 0) return std::vector<Point>{};
-        
-        find_result_vector_t<Point> results;
-        find_nearest_n_r(root.get(), key, 0, kdim, num, results);
+        if (storage.nodes.empty() || num == 0) return std::vector<Point>{};
 
         std::vector<Point> points;
-        std::ranges::transform(
-            results, std::back_inserter(points),
-            [](const auto& res) { return res.first->value(); });
-
+        results_to_points(storage, find_nearest_n(storage, key, kdim, num, leaf_size, eps, thread_result_heap<Point>()), points);
         return points;
     }
+
+    // Calls visitor(index, distance) for every point not further than
+    // sqrt(radius_sqr) from the key, in no particular order.
+    template<point Point, class Storage, class Visitor>
+    void scan_within_radius(
+        const Storage& storage,
+        const subtree& bucket,
+        const Point& key,
+        const auto& kdim,
+        const point_distance_t<Point>& radius_sqr,
+        Visitor& visitor) {
+
+        if (!storage.coords.empty()) {
+            alignas(coordinate_storage<point_distance_t<Point>>::alignment) dist_block_t<Point> dists;
+
+            for (auto first = bucket.node; first < bucket.end; first += dist_block_size) {
+                const auto count = std::min(dist_block_size, bucket.end - first);
+
+                if (dist_sqr_block(storage, first, count, key, kdim, dists) > radius_sqr) {
+                    continue;
+                }
+
+                for (size_t j = 0; j < count; ++j) {
+                    if (dists[j] <= radius_sqr && !is_erased(storage, first + j)) {
+                        visitor(first + j, dists[j]);
+                    }
+                }
+            }
+
+            return;
+        }
+
+        for (auto i = bucket.node; i < bucket.end; ++i) {
+            const auto dist = dist_sqr(key, point_at(storage, i), kdim);
+            if (dist <= radius_sqr && !is_erased(storage, i)) {
+                visitor(i, dist);
+            }
+        }
+    }
+
+    template<point Point, class Storage, class Visitor, class Stats = no_search_stats>
+    void visit_within_radius_iter(
+        const Storage& storage,
+        const Point& key,
+        const auto& kdim,
+        const size_t leaf_size,
+        const point_distance_t<Point>& radius_sqr,
+        Visitor& visitor,
+        Stats&& stats = {}) {
+
+        // subtrees are pushed only if they intersect the ball
+        traversal_stack<pending_subtree<Point>> stack;
+        stack.push({ { 0, storage.nodes.size() }, 0 });
+
+        while (!stack.empty()) {
+            auto [root, bound] = stack.pop();
+
+            if (!has_live(storage, root)) {
+                continue;
+            }
+            if (root.node != 0) {
+                stats.descend_far();
+            }
+
+            while (true) {
+                if (root.end - root.node <= leaf_size) {
+                    stats.scan_leaf(root.end - root.node);
+                    scan_within_radius(storage, root, key, kdim, radius_sqr, visitor);
+                    break;
+                }
+
+                stats.visit_node();
+                const auto& record = storage.nodes[root.node];
+                const auto& value = point_at(storage, root.node);
+                const auto dist = dist_sqr(key, value, kdim);
+
+                if (dist <= radius_sqr && !is_erased(storage, root.node)) {
+                    visitor(root.node, dist);
+                }
+
+                const auto axis = record.axis;
+                const auto delta = value[axis] - key[axis];
+                const auto delta2 = delta * delta;
+
+                const subtree left{ root.node + 1, record.right };
+                const subtree right{ record.right, root.end };
+
+                const auto& [selected, other] = delta > 0
+                    ? std::make_pair(left, right)
+                    : std::make_pair(right, left);
+
+                if (other.node != other.end && delta2 <= radius_sqr) {
+                    stack.push({ other, delta2 });
+                    stats.stack_depth(stack.size());
+                }
+
+                if (selected.node == selected.end || !has_live(storage, selected)) {
+                    break;
+                }
+
+                root = selected;
+            }
+        }
+    }
+
+    template<point Point, class Storage, class Visitor, class Stats = no_search_stats>
+    void visit_within_radius(
+        const Storage& storage,
+        const Point& key,
+        const auto& kdim,
+        const point_distance_t<Point>& radius_sqr,
+        const size_t leaf_size,
+        Visitor&& visitor,
+        Stats&& stats = {}) {
+
+        if (storage.nodes.empty() || radius_sqr < 0) return;
+
+        dispatch_kdim(kdim, [&](const auto& dim) {
+            visit_within_radius_iter(storage, key, dim, leaf_size, radius_sqr, visitor, stats);
+        });
+    }
 }
\ No newline at end of file
@@ -0,0 +1,126 @@
+#pragma once
+
+#include "node_storage.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <ostream>
+#include <vector>
+
+namespace kdtree {
+
+    // Shape and memory use of a tree, to notice a degenerate build, e.g.
+    // from inputs with many duplicate points, before queries slow down.
+    // Depths count the split nodes above a leaf, a leaf being a bucket of
+    // up to leaf_size points that is scanned rather than split.
+    struct tree_stats {
+        size_t size = 0;  // points, erased ones included
+        size_t live = 0;  // points not erased
+        size_t split_nodes = 0;
+        size_t leaves = 0;
+        size_t max_depth = 0;
+        double average_leaf_depth = 0;
+        double balance = 1;  // max_depth over that of a median split tree of the same size, 1 at best
+        size_t node_bytes = 0;  // node records and erase bookkeeping
+        size_t point_bytes = 0;  // points, without memory they own
+        size_t coordinate_bytes = 0;  // structure-of-arrays and packed copies of coordinates
+        std::vector<std::vector<size_t>> split_axes;  // split_axes[d][a] split nodes at depth d along axis a
+    };
+
+    namespace detail {
+        // Depth of the deepest leaf when every split is at the median.
+        inline size_t balanced_depth(size_t size, const size_t leaf_size) {
+            size_t depth = 0;
+            for (; size > leaf_size; size /= 2) {
+                ++depth;
+            }
+            return depth;
+        }
+
+        // Walks the tree with an explicit stack, so deep hand-made trees
+        // are as safe as built ones.
+        template<class Storage>
+        tree_stats make_tree_stats(const Storage& storage, const size_t kdim, const size_t leaf_size) {
+            using point_t = typename Storage::point_type;
+            using distance_t = point_distance_t<point_t>;
+
+            tree_stats stats;
+            stats.size = storage.nodes.size();
+            stats.live = storage.live.empty() ? storage.nodes.size() : storage.live[0];
+            stats.node_bytes = storage.nodes.size() * sizeof(flat_node) + storage.dead.size() + storage.live.size() * sizeof(size_t);
+            stats.point_bytes = storage.points.size() * sizeof(point_t);
+            stats.coordinate_bytes = (storage.coords.values.size() + storage.packed.values.size()) * sizeof(distance_t);
+
+            if (storage.nodes.empty()) {
+                return stats;
+            }
+
+            struct pending_range {
+                size_t node;
+                size_t end;
+                size_t depth;
+            };
+
+            size_t depth_sum = 0;
+            std::vector<pending_range> stack{ { 0, storage.nodes.size(), 0 } };
+
+            while (!stack.empty()) {
+                const auto [node, end, depth] = stack.back();
+                stack.pop_back();
+
+                if (end - node <= leaf_size) {
+                    ++stats.leaves;
+                    depth_sum += depth;
+                    stats.max_depth = std::max(stats.max_depth, depth);
+                    continue;
+                }
+
+                const auto& record = storage.nodes[node];
+                ++stats.split_nodes;
+                if (stats.split_axes.size() <= depth) {
+                    stats.split_axes.resize(depth + 1, std::vector<size_t>(kdim));
+                }
+                ++stats.split_axes[depth][std::min<size_t>(record.axis, kdim - 1)];
+
+                if (node + 1 < record.right) {
+                    stack.push_back({ node + 1, record.right, depth + 1 });
+                }
+                if (record.right < end) {
+                    stack.push_back({ record.right, end, depth + 1 });
+                }
+            }
+
+            stats.average_leaf_depth = double(depth_sum) / double(stats.leaves);
+
+            const auto balanced = balanced_depth(stats.size, leaf_size);
+            stats.balance = balanced == 0 ? 1.0 : double(stats.max_depth) / double(balanced);
+
+            return stats;
+        }
+    }
+
+    // Writes the statistics as a single line JSON object.
+    inline std::ostream& operator<<(std::ostream& os, const tree_stats& stats) {
+        os << "{\"size\":" << stats.size
+            << ",\"live\":" << stats.live
+            << ",\"split_nodes\":" << stats.split_nodes
+            << ",\"leaves\":" << stats.leaves
+            << ",\"max_depth\":" << stats.max_depth
+            << ",\"average_leaf_depth\":" << stats.average_leaf_depth
+            << ",\"balance\":" << stats.balance
+            << ",\"node_bytes\":" << stats.node_bytes
+            << ",\"point_bytes\":" << stats.point_bytes
+            << ",\"coordinate_bytes\":" << stats.coordinate_bytes
+            << ",\"split_axes\":[";
+
+        for (size_t depth = 0; depth < stats.split_axes.size(); ++depth) {
+            os << (depth ? ",[" : "[");
+            for (size_t axis = 0; axis < stats.split_axes[depth].size(); ++axis) {
+                os << (axis ? "," : "") << stats.split_axes[depth][axis];
+            }
+            os << "]";
+        }
+
+        return os << "]}";
+    }
+}
@@ -0,0 +1,94 @@
+#include <kdtree/dynamic_tree.hpp>
+#include <kdtree/point2d.hpp>
+#include <kdtree/point3d.hpp>
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <limits>
+#include <random>
+#include <span>
+#include <vector>
+
+namespace kd = kdtree;
+
+namespace {
+    template<class Point>
+    void expect_levels(const kd::dynamic_tree<Point>& tree) {
+        const auto levels = tree.levels();
+        for (size_t i = 0; i < levels.size(); ++i) {
+            const auto size = levels[i].storage().points.size();
+            EXPECT_EQ(size, (tree.size() >> i & 1) << i);
+        }
+    }
+}
+
+TEST(dynamic_tree, empty) {
+    const kd::dynamic_tree<kd::float2> tree(2);
+    EXPECT_TRUE(tree.is_empty());
+    EXPECT_EQ(tree.find_nearest_neighbor({ 1, 2 }).distance_sqr, std::numeric_limits<float>::max());
+    EXPECT_TRUE(tree.find_nearest_n({ 1, 2 }, 3).empty());
+    EXPECT_EQ(tree.count_within_radius({ 1, 2 }, 10), 0);
+}
+
+TEST(dynamic_tree, insert) {
+    std::default_random_engine rng(42);
+    std::normal_distribution<float> nd;
+
+    kd::dynamic_tree<kd::float3> tree(3, { .leaf_size = 4 });
+    std::vector<kd::float3> points;
+
+    for (auto i = 0; i < 1000; ++i) {
+        const kd::float3 p{ nd(rng), nd(rng), nd(rng) };
+        tree.insert(p);
+        points.push_back(p);
+
+        ASSERT_EQ(tree.size(), points.size());
+        expect_levels(tree);
+
+        const kd::float3 key{ nd(rng), nd(rng), nd(rng) };
+        const auto dist = [&key](const kd::float3& q) { return kd::detail::dist_sqr(key, q, 3); };
+        const auto nearest = tree.find_nearest_neighbor(key);
+        EXPECT_EQ(nearest.distance_sqr, dist(std::ranges::min(points, std::less(), dist)));
+        EXPECT_EQ(nearest.distance_sqr, dist(nearest.value));
+    }
+}
+
+TEST(dynamic_tree, find_nearest_n) {
+    std::default_random_engine rng(42);
+    std::normal_distribution<float> nd;
+
+    std::vector<kd::float2> points(3000);
+    for (auto& p : points) {
+        p = { nd(rng), nd(rng) };
+    }
+
+    const auto expected{ kd::build_tree(points) };
+    auto tree{ kd::build_dynamic_tree(std::span(points).first(2000)) };
+    for (size_t i = 2000; i < points.size(); ++i) {
+        tree.insert(points[i]);
+    }
+
+    EXPECT_EQ(tree.size(), points.size());
+    expect_levels(tree);
+
+    std::vector<kd::dynamic_tree<kd::float2>::neighbor_type> out(16);
+    for (auto i = 0; i < 100; ++i) {
+        const kd::float2 key{ nd(rng), nd(rng) };
+
+        EXPECT_EQ(tree.find_nearest(key), expected.find_nearest(key));
+        EXPECT_EQ(tree.find_nearest_n(key, 16), expected.find_nearest_n(key, 16));
+
+        ASSERT_EQ(tree.find_nearest_neighbors(key, out), out.size());
+        const auto nearest{ expected.find_nearest_n(key, out.size()) };
+        for (size_t j = 0; j < out.size(); ++j) {
+            EXPECT_EQ(out[j].value, nearest[j]);
+        }
+
+        EXPECT_EQ(tree.count_within_radius(key, 0.5f), expected.count_within_radius(key, 0.5f));
+
+        auto within{ tree.find_within_radius(key, 0.5f) };
+        auto within_expected{ expected.find_within_radius(key, 0.5f) };
+        std::ranges::sort(within);
+        std::ranges::sort(within_expected);
+        EXPECT_EQ(within, within_expected);
+    }
+}
@@ -0,0 +1,150 @@
+#include <kdtree/external_build.hpp>
+#include <kdtree/point2d.hpp>
+#include <kdtree/point3d.hpp>
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <span>
+#include <string>
+#include <vector>
+
+namespace kd = kdtree;
+
+namespace {
+    std::filesystem::path temp_path(const std::string& name) {
+        return std::filesystem::temp_directory_path() / ("kdtree_test_" + name);
+    }
+
+    template<class Point>
+    void write_points(const std::filesystem::path& path, const std::vector<Point>& points) {
+        std::ofstream(path, std::ios::binary | std::ios::trunc)
+            .write(reinterpret_cast<const char*>(points.data()), std::streamsize(points.size() * sizeof(Point)));
+    }
+
+    // every point of a subtree lies on the side of its root's splitting
+    // plane that the subtree is on
+    template<class Storage>
+    void expect_split_invariant(const Storage& storage, const size_t leaf_size) {
+        struct range { size_t node, end; };
+        std::vector<range> pending{ { 0, storage.nodes.size() } };
+
+        while (!pending.empty()) {
+            const auto [node, end] = pending.back();
+            pending.pop_back();
+            if (end - node <= leaf_size) {
+                continue;
+            }
+
+            const auto& [right, axis] = storage.nodes[node];
+            const auto value = storage.points[node][axis];
+            for (auto i = node + 1; i < right; ++i) {
+                ASSERT_LE(storage.points[i][axis], value);
+            }
+            for (auto i = right; i < end; ++i) {
+                ASSERT_GE(storage.points[i][axis], value);
+            }
+
+            pending.push_back({ node + 1, right });
+            pending.push_back({ right, end });
+        }
+    }
+}
+
+TEST(external_build, matches_in_memory_tree) {
+    std::default_random_engine rng(42);
+    std::normal_distribution<float> nd;
+
+    std::vector<kd::float3> points(20000);
+    for (auto& p : points) {
+        p = { nd(rng), nd(rng), nd(rng) };
+    }
+    // duplicates along every axis
+    for (size_t i = 0; i < 2000; ++i) {
+        points[i] = { 0.5f, 0.5f, 0.5f };
+    }
+
+    std::vector<kd::float3> keys(100);
+    for (auto& p : keys) {
+        p = { nd(rng), nd(rng), nd(rng) };
+    }
+
+    const auto points_path = temp_path("external_points.bin");
+    const auto tree_path = temp_path("external_tree.kdt");
+    const auto scratch = temp_path("external_scratch");
+    write_points(points_path, points);
+    std::filesystem::create_directories(scratch);
+
+    const auto expected{ kd::build_tree(points) };
+
+    auto sorted_points = points;
+    std::ranges::sort(sorted_points);
+
+    for (const auto split : { kd::split_rule::round_robin, kd::split_rule::widest_spread, kd::split_rule::sliding_midpoint }) {
+        for (const auto layout : { kd::coordinate_layout::aos, kd::coordinate_layout::soa }) {
+            const kd::build_options options{ .leaf_size = 8, .layout = layout, .split = split };
+            kd::build_tree_file<kd::float3>(points_path, tree_path, 3, options, { .memory_budget = 40000, .sample_size = 101, .temp_directory = scratch });
+
+            const kd::mapped_tree<kd::float3> mapped(tree_path);
+            ASSERT_EQ(mapped.size(), points.size());
+            EXPECT_EQ(mapped.leaf_size(), 8);
+            EXPECT_EQ(mapped.storage().coords.empty(), layout == kd::coordinate_layout::aos);
+            std::vector<kd::float3> tree_points(mapped.storage().points.begin(), mapped.storage().points.end());
+            std::ranges::sort(tree_points);
+            EXPECT_EQ(tree_points, sorted_points);
+            expect_split_invariant(mapped.storage(), 8);
+
+            for (const auto& key : keys) {
+                EXPECT_FLOAT_EQ(mapped.find_nearest_neighbor(key).distance_sqr, expected.find_nearest_neighbor(key).distance_sqr);
+                EXPECT_EQ(mapped.count_within_radius(key, 0.5f), expected.count_within_radius(key, 0.5f));
+
+                const auto nearest = mapped.find_nearest_n(key, 5);
+                const auto nearest_expected = expected.find_nearest_n(key, 5);
+                ASSERT_EQ(nearest.size(), nearest_expected.size());
+                for (size_t i = 0; i < nearest.size(); ++i) {
+                    EXPECT_FLOAT_EQ(kd::detail::dist_sqr(key, nearest[i], 3), kd::detail::dist_sqr(key, nearest_expected[i], 3));
+                }
+            }
+
+            EXPECT_TRUE(std::filesystem::is_empty(scratch));
+        }
+    }
+
+    std::filesystem::remove(points_path);
+    std::filesystem::remove(tree_path);
+    std::filesystem::remove(scratch);
+}
+
+TEST(external_build, fits_in_memory) {
+    const std::vector<kd::int2> points{ { -4, 9 }, { 4, 0 }, { -3, -4 }, { 8, 0 }, { 0, -7 } };
+    const auto points_path = temp_path("external_small.bin");
+    const auto tree_path = temp_path("external_small.kdt");
+    write_points(points_path, points);
+
+    kd::build_tree_file<kd::int2>(points_path, tree_path, 2);
+
+    const auto expected{ kd::build_tree(points) };
+    const kd::mapped_tree<kd::int2> mapped(tree_path);
+    EXPECT_TRUE(std::ranges::equal(mapped.storage().points, expected.storage().points));
+    EXPECT_TRUE(std::ranges::equal(mapped.storage().nodes, expected.storage().nodes));
+
+    std::filesystem::remove(points_path);
+    std::filesystem::remove(tree_path);
+}
+
+TEST(external_build, empty) {
+    const auto points_path = temp_path("external_empty.bin");
+    const auto tree_path = temp_path("external_empty.kdt");
+    write_points(points_path, std::vector<kd::float2>());
+
+    kd::build_tree_file<kd::float2>(points_path, tree_path, 2);
+    const kd::mapped_tree<kd::float2> mapped(tree_path);
+    EXPECT_TRUE(mapped.is_empty());
+
+    std::filesystem::resize_file(points_path, 3);
+    EXPECT_THROW(kd::build_tree_file<kd::float2>(points_path, tree_path, 2), std::runtime_error);
+
+    std::filesystem::remove(points_path);
+    std::filesystem::remove(tree_path);
+}
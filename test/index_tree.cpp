@@ -0,0 +1,131 @@
+#include <kdtree/index_tree.hpp>
+#include <kdtree/point2d.hpp>
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace kd = kdtree;
+
+namespace {
+    struct labeled_point {
+        float x, y;
+        std::string label;
+
+        float operator[](size_t index) const {
+            return index == 0 ? x : y;
+        }
+    };
+}
+
+namespace kdtree {
+    template<>
+    struct point_distance<labeled_point> {
+        using type = float;
+    };
+
+    template<>
+    struct point_kdim<labeled_point> {
+        static constexpr auto value = 2;
+    };
+}
+
+TEST(index_tree, empty) {
+    const std::vector<kd::float2> points;
+    const auto tree{ kd::build_index_tree(points) };
+    EXPECT_TRUE(tree.is_empty());
+    EXPECT_EQ(tree.find_nearest({ 1, 2 }), tree.npos);
+    EXPECT_EQ(tree.find_nearest_neighbor({ 1, 2 }).value, tree.npos);
+    EXPECT_TRUE(tree.find_nearest_n({ 1, 2 }, 3).empty());
+}
+
+TEST(index_tree, custom_point) {
+    const std::vector<labeled_point> points{
+        { -4, 9, "one" },
+        { 4, 0, "two" },
+        { -3, -4, "three" },
+        { 8, 0, "four" },
+        { 0, -7, "five" },
+    };
+
+    const auto tree{ kd::build_index_tree(points) };
+    EXPECT_EQ(tree.points().data(), points.data());
+    EXPECT_EQ(tree.refs().storage().points.size(), points.size());
+
+    const auto nearest = tree.find_nearest({ 9, 1, "key" });
+    ASSERT_LT(nearest, points.size());
+    EXPECT_EQ(points[nearest].label, "four");
+
+    EXPECT_EQ(tree.find_nearest_n({ 9, 1, "key" }, 2), (std::vector<size_t>{ 3, 1 }));
+
+    std::vector<kd::index_tree<labeled_point>::neighbor_type> out(2);
+    ASSERT_EQ(tree.find_nearest_neighbors({ 9, 1, "key" }, out), 2);
+    EXPECT_EQ(out[0], (kd::index_tree<labeled_point>::neighbor_type{ 3, 2 }));
+    EXPECT_EQ(out[1], (kd::index_tree<labeled_point>::neighbor_type{ 1, 26 }));
+    EXPECT_EQ(tree.find_nearest_neighbor({ 9, 1, "key" }), out[0]);
+    EXPECT_EQ(tree.count_within_radius({ 0, 0, "key" }, 5), 2);
+}
+
+TEST(index_tree, find_nearest) {
+    std::default_random_engine rng(42);
+    std::normal_distribution<float> nd;
+
+    std::vector<kd::float2> points(2000);
+    for (auto& p : points) {
+        p = { nd(rng), nd(rng) };
+    }
+
+    const auto tree{ kd::build_index_tree(points, { .leaf_size = 8 }) };
+    const auto expected{ kd::build_tree(points, { .leaf_size = 8 }) };
+
+    for (auto i = 0; i < 100; ++i) {
+        const kd::float2 key{ nd(rng), nd(rng) };
+
+        EXPECT_EQ(points[tree.find_nearest(key)], expected.find_nearest(key));
+
+        const auto indices{ tree.find_nearest_n(key, 10) };
+        const auto nearest{ expected.find_nearest_n(key, 10) };
+        ASSERT_EQ(indices.size(), nearest.size());
+        for (size_t j = 0; j < indices.size(); ++j) {
+            EXPECT_EQ(points[indices[j]], nearest[j]);
+        }
+
+        auto within{ tree.find_within_radius(key, 0.5f) };
+        std::ranges::sort(within);
+        std::vector<size_t> brute;
+        for (size_t j = 0; j < points.size(); ++j) {
+            if (kd::detail::dist_sqr(key, points[j], 2) <= 0.25f) {
+                brute.push_back(j);
+            }
+        }
+        EXPECT_EQ(within, brute);
+    }
+}
+
+TEST(index_tree, runtime_kdim) {
+    std::default_random_engine rng(42);
+    std::normal_distribution<float> nd;
+
+    std::vector<std::vector<float>> points(1000, std::vector<float>(5));
+    for (auto& p : points) {
+        std::ranges::generate(p, [&]() { return nd(rng); });
+    }
+
+    const auto tree{ kd::index_tree<std::vector<float>>::build(points, 5) };
+    EXPECT_EQ(tree.kdim(), 5);
+
+    for (auto i = 0; i < 20; ++i) {
+        std::vector<float> key(5);
+        std::ranges::generate(key, [&]() { return nd(rng); });
+
+        const auto dist = [&key, &points](size_t j) { return kd::detail::dist_sqr(key, points[j], 5); };
+        size_t brute = 0;
+        for (size_t j = 1; j < points.size(); ++j) {
+            if (dist(j) < dist(brute)) {
+                brute = j;
+            }
+        }
+        EXPECT_EQ(dist(tree.find_nearest(key)), dist(brute));
+    }
+}
@@ -0,0 +1,148 @@
+#include <kdtree/mapped_tree.hpp>
+#include <kdtree/point2d.hpp>
+#include <kdtree/point3d.hpp>
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace kd = kdtree;
+
+namespace {
+    std::filesystem::path temp_tree_path(const std::string& name) {
+        return std::filesystem::temp_directory_path() / ("kdtree_test_" + name + ".kdt");
+    }
+
+    template<class Tree, class Mapped, class Key>
+    void expect_same_queries(const Tree& tree, const Mapped& mapped, const std::vector<Key>& keys) {
+        ASSERT_EQ(mapped.size(), tree.size());
+        ASSERT_EQ(mapped.kdim(), tree.kdim());
+        ASSERT_EQ(mapped.leaf_size(), tree.leaf_size());
+
+        for (const auto& key : keys) {
+            EXPECT_EQ(mapped.find_nearest(key), tree.find_nearest(key));
+            EXPECT_EQ(mapped.find_nearest_neighbor(key), tree.find_nearest_neighbor(key));
+            EXPECT_EQ(mapped.find_nearest_n(key, 7), tree.find_nearest_n(key, 7));
+            EXPECT_EQ(mapped.find_within_radius(key, 1), tree.find_within_radius(key, 1));
+            EXPECT_EQ(mapped.count_within_radius(key, 1), tree.count_within_radius(key, 1));
+        }
+    }
+}
+
+TEST(mapped_tree, round_trip) {
+    std::default_random_engine rng(42);
+    std::normal_distribution<float> nd;
+
+    std::vector<kd::float3> points(5000);
+    for (auto& p : points) {
+        p = { nd(rng), nd(rng), nd(rng) };
+    }
+
+    std::vector<kd::float3> keys(100);
+    for (auto& p : keys) {
+        p = { nd(rng), nd(rng), nd(rng) };
+    }
+
+    const auto path = temp_tree_path("round_trip");
+
+    for (const auto layout : { kd::coordinate_layout::aos, kd::coordinate_layout::soa }) {
+        auto tree{ kd::build_tree(points, { .leaf_size = 8, .layout = layout }) };
+        for (size_t i = 0; i < 1000; ++i) {
+            tree.erase(points[i]);
+        }
+
+        kd::save_tree(tree, path);
+        const kd::mapped_tree<kd::float3> mapped(path);
+
+        EXPECT_TRUE(std::ranges::equal(mapped.storage().points, tree.storage().points));
+        EXPECT_TRUE(std::ranges::equal(mapped.storage().nodes, tree.storage().nodes));
+        EXPECT_EQ(mapped.storage().coords.empty(), layout == kd::coordinate_layout::aos);
+        EXPECT_EQ(mapped.stats().balance, tree.stats().balance);
+        expect_same_queries(tree, mapped, keys);
+    }
+
+    std::filesystem::remove(path);
+}
+
+TEST(mapped_tree, int_points) {
+    const auto tree{ kd::build_tree({ kd::int2{ -4, 9 }, kd::int2{ 4, 0 }, kd::int2{ -3, -4 }, kd::int2{ 8, 0 }, kd::int2{ 0, -7 } }) };
+    const auto path = temp_tree_path("int_points");
+
+    kd::save_tree(tree, path);
+    auto mapped = kd::mapped_tree<kd::int2>(path);
+    expect_same_queries(tree, mapped, std::vector<kd::int2>{ { 9, 1 }, { 0, 0 }, { -5, 5 } });
+
+    // moves keep the mapping alive
+    const auto moved = std::move(mapped);
+    EXPECT_EQ(moved.find_nearest({ 9, 1 }), (kd::int2{ 8, 0 }));
+
+    std::filesystem::remove(path);
+}
+
+TEST(mapped_tree, empty) {
+    const auto path = temp_tree_path("empty");
+
+    kd::save_tree(kd::tree<kd::float2>(), path);
+    const kd::mapped_tree<kd::float2> mapped(path);
+    EXPECT_TRUE(mapped.is_empty());
+    EXPECT_TRUE(mapped.find_nearest_n({ 1, 2 }, 3).empty());
+
+    std::filesystem::remove(path);
+}
+
+TEST(mapped_tree, invalid_files) {
+    const auto path = temp_tree_path("invalid");
+
+    EXPECT_THROW(kd::mapped_tree<kd::float2>(temp_tree_path("missing")), std::runtime_error);
+
+    kd::save_tree(kd::build_tree({ kd::float3{ 1, 2, 3 } }), path);
+    EXPECT_THROW(kd::mapped_tree<kd::double3>{ path }, std::runtime_error);
+    EXPECT_THROW(kd::mapped_tree<kd::int3>{ path }, std::runtime_error);
+
+    // truncated
+    std::filesystem::resize_file(path, 100);
+    EXPECT_THROW(kd::mapped_tree<kd::float3>{ path }, std::runtime_error);
+
+    std::ofstream(path, std::ios::binary | std::ios::trunc) << "not a tree";
+    EXPECT_THROW(kd::mapped_tree<kd::float3>{ path }, std::runtime_error);
+
+    std::filesystem::remove(path);
+}
+
+TEST(mapped_tree, corrupt_header) {
+    const auto path = temp_tree_path("corrupt");
+
+    std::vector<kd::float3> points(100);
+    for (size_t i = 0; i < points.size(); ++i) {
+        points[i] = { float(i), float(i % 7), float(i % 13) };
+    }
+    kd::save_tree(kd::build_tree(points, { .layout = kd::coordinate_layout::soa }), path);
+
+    kd::tree_file_header saved;
+    std::ifstream(path, std::ios::binary).read(reinterpret_cast<char*>(&saved), sizeof(saved));
+    ASSERT_NE(saved.coords, 0u);
+    EXPECT_NO_THROW(kd::mapped_tree<kd::float3>{ path });
+
+    const auto expect_refused = [&path, &saved](const auto& patch) {
+        auto header = saved;
+        patch(header);
+        std::fstream(path, std::ios::binary | std::ios::in | std::ios::out)
+            .write(reinterpret_cast<const char*>(&header), sizeof(header));
+        EXPECT_THROW(kd::mapped_tree<kd::float3>{ path }, std::runtime_error);
+    };
+
+    // sizes whose byte counts wrap around
+    expect_refused([](auto& h) { h.coords_size = std::uint64_t(1) << 62; h.coords_stride = std::uint64_t(1) << 40; });
+    expect_refused([](auto& h) { h.size = std::uint64_t(1) << 62; });
+    expect_refused([](auto& h) { h.size = ~std::uint64_t(0) / sizeof(kd::float3) + 2; });
+    // coordinates without the padding the searches read
+    expect_refused([](auto& h) { h.coords_stride = h.size - 1; });
+    expect_refused([](auto& h) { h.coords_size = h.coords_stride * h.kdim; });
+    expect_refused([](auto& h) { h.coords_stride += h.coords_size; });
+
+    std::filesystem::remove(path);
+}
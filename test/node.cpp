@@ -1,6 +1,9 @@
 #include <gtest/gtest.h>
 #include "kdtree/node.hpp"
 #include "kdtree/point2d.hpp"
+#include <memory_resource>
+#include <sstream>
+#include <vector>
 
 namespace kd = kdtree;
 
@@ -62,4 +65,103 @@ TEST(node, equals_complex) {
     EXPECT_TRUE(tree3 != tree1);
     EXPECT_TRUE(tree3 != tree2);
     EXPECT_TRUE(tree3 == tree3);
-}
\ No newline at end of file
+}
+
+TEST(node, deep_tree) {
+    // deep enough to overflow the call stack with recursive traversal
+    constexpr int depth = 1000000;
+
+    auto make_chain = []() {
+        auto root = kd::make_node(kd::int2{ depth, depth });
+        for (auto i = depth - 1; i >= 0; --i) {
+            root = kd::make_node(kd::int2{ i, i }, kd::make_leaf<kd::int2>(), std::move(root));
+        }
+        return root;
+    };
+
+    const auto chain1 = make_chain();
+    const auto chain2 = make_chain();
+    EXPECT_TRUE(*chain1 == *chain2);
+
+    chain2->right()->right()->value() = { -1, -1 };
+    EXPECT_TRUE(*chain1 != *chain2);
+
+    // output grows with the square of the depth, so print a shorter chain
+    auto short_chain = kd::make_node(kd::int2{ 0, 0 });
+    for (auto i = 0; i < 1000; ++i) {
+        short_chain = kd::make_node(kd::int2{ 0, 0 }, std::move(short_chain), kd::make_leaf<kd::int2>());
+    }
+
+    std::ostringstream os;
+    os << *short_chain;
+    const auto text = os.str();
+    EXPECT_EQ(std::count(text.begin(), text.end(), '\n'), 1001);
+
+}
+
+namespace {
+    // Upstream resource that counts what passes through it.
+    class counting_resource : public std::pmr::memory_resource {
+    public:
+        int allocations = 0;
+        int deallocations = 0;
+
+    private:
+        void* do_allocate(size_t bytes, size_t alignment) override {
+            ++allocations;
+            return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+        }
+
+        void do_deallocate(void* p, size_t bytes, size_t alignment) override {
+            ++deallocations;
+            std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+        }
+
+        bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+            return this == &other;
+        }
+    };
+}
+
+TEST(node, allocate_node) {
+    counting_resource resource;
+    {
+        const auto root = kd::allocate_node(resource, kd::float2{ 0, 0 },
+            kd::allocate_node(resource, kd::float2{ 1, 2 }),
+            kd::make_node(kd::float2{ 3, 4 }));
+
+        EXPECT_EQ(resource.allocations, 2);
+        EXPECT_TRUE(*root == kd::node(kd::float2{ 0, 0 }, kd::make_node(kd::float2{ 1, 2 }), kd::make_node(kd::float2{ 3, 4 })));
+    }
+    EXPECT_EQ(resource.deallocations, 2);
+}
+
+TEST(node, arena) {
+    counting_resource upstream;
+    {
+        kd::node_arena<kd::int2> arena(&upstream);
+
+        constexpr int depth = 1000000;
+        auto root = arena.make_node(kd::int2{ depth, depth });
+        for (auto i = depth - 1; i >= 0; --i) {
+            root = arena.make_node(kd::int2{ i, i }, kd::make_leaf<kd::int2>(), std::move(root));
+        }
+
+        // blocks grow geometrically
+        EXPECT_LT(upstream.allocations, 64);
+        EXPECT_EQ(root->right()->right()->value(), (kd::int2{ 2, 2 }));
+    }
+    EXPECT_EQ(upstream.deallocations, upstream.allocations);
+
+    // points that own memory are still destroyed
+    {
+        kd::node_arena<std::vector<float>> arena(16);
+        auto root = arena.make_node(std::vector{ 1.f, 2.f },
+            arena.make_node(std::vector{ 0.f, 5.f }),
+            arena.make_node(std::vector{ 3.f, 1.f }));
+
+        EXPECT_TRUE(*root == kd::node(std::vector{ 1.f, 2.f },
+            kd::make_node(std::vector{ 0.f, 5.f }),
+            kd::make_node(std::vector{ 3.f, 1.f })));
+    }
+}
@@ -0,0 +1,111 @@
+#include <gtest/gtest.h>
+#include <kdtree/node_storage.hpp>
+#include <kdtree/point2d.hpp>
+#include <kdtree/point3d.hpp>
+#include <kdtree/simd.hpp>
+#include <random>
+#include <vector>
+
+namespace kd = kdtree;
+
+namespace {
+    const kd::simd_level all_levels[] = {
+        kd::simd_level::scalar,
+        kd::simd_level::sse2,
+        kd::simd_level::avx2,
+        kd::simd_level::avx512,
+    };
+
+    template<class Point>
+    void test_dist_block_kernels() {
+        using distance_t = kd::point_distance_t<Point>;
+
+        std::default_random_engine rng(42);
+        std::uniform_int_distribution<int> ud(-100, 100);
+
+        std::vector<Point> points(300);
+        for (auto& p : points) {
+            for (auto& x : p) x = distance_t(ud(rng)) / 8;
+        }
+
+        const auto kdim = kd::point_kdim_v<Point>;
+        const auto coords = kd::detail::make_coordinates(points, kdim);
+
+        Point key;
+        for (auto& x : key) x = distance_t(ud(rng)) / 8;
+
+        const auto expected_kernel = kd::detail::get_dist_block_kernel<Point>(kd::simd_level::scalar);
+
+        for (const auto level : all_levels) {
+            const auto kernel = kd::detail::get_dist_block_kernel<Point>(level);
+
+            for (const size_t first : { 0, 1, 5, 17, 236, 299 }) {
+                for (const size_t count : { 1, 3, 8, 15, 16, 33, 64 }) {
+                    if (first + count > points.size()) continue;
+
+                    alignas(64) kd::detail::dist_block_t<Point> expected;
+                    alignas(64) kd::detail::dist_block_t<Point> actual;
+
+                    const auto expected_min = expected_kernel(
+                        coords.values.data() + first, coords.stride, key, kdim, count, expected.data());
+                    const auto actual_min = kernel(
+                        coords.values.data() + first, coords.stride, key, kdim, count, actual.data());
+
+                    EXPECT_EQ(expected_min, actual_min);
+                    for (size_t j = 0; j < count; ++j) {
+                        EXPECT_EQ(expected[j], actual[j]);
+                        EXPECT_EQ(actual[j], kd::detail::dist_sqr_scalar(points[first + j].data(), key.data(), kdim));
+                    }
+                }
+            }
+        }
+    }
+
+    template<class T>
+    void test_dist_sqr_kernels() {
+        std::default_random_engine rng(42);
+        std::normal_distribution<T> nd;
+
+        for (const size_t n : { 1, 2, 7, 16, 31, 128, 130 }) {
+            std::vector<T> a(n), b(n);
+            for (auto& x : a) x = nd(rng);
+            for (auto& x : b) x = nd(rng);
+
+            const auto expected = kd::detail::dist_sqr_scalar(a.data(), b.data(), n);
+
+            for (const auto level : all_levels) {
+                const auto actual = kd::detail::get_dist_sqr_kernel<T>(level)(a.data(), b.data(), n);
+                EXPECT_NEAR(expected, actual, expected * 1e-5);
+            }
+        }
+    }
+}
+
+TEST(simd, detect_level) {
+    EXPECT_EQ(kd::max_simd_level(), kd::detect_simd_level());
+}
+
+TEST(simd, dist_block_float) {
+    test_dist_block_kernels<kd::float2>();
+    test_dist_block_kernels<kd::float3>();
+    test_dist_block_kernels<std::array<float, 9>>();
+}
+
+TEST(simd, dist_block_double) {
+    test_dist_block_kernels<kd::double2>();
+    test_dist_block_kernels<kd::double3>();
+    test_dist_block_kernels<std::array<double, 9>>();
+}
+
+TEST(simd, dist_block_int) {
+    test_dist_block_kernels<kd::int2>();
+    test_dist_block_kernels<kd::int3>();
+}
+
+TEST(simd, dist_sqr_float) {
+    test_dist_sqr_kernels<float>();
+}
+
+TEST(simd, dist_sqr_double) {
+    test_dist_sqr_kernels<double>();
+}
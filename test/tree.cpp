@@ -2,6 +2,14 @@
 #include <kdtree/point2d.hpp>
 #include <kdtree/point3d.hpp>
 #include <gtest/gtest.h>
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <limits>
+#include <random>
+#include <span>
+#include <sstream>
+#include <stdexcept>
 #include <vector>
 
 namespace kd = kdtree;
@@ -19,6 +27,34 @@ TEST(tree, single_node) {
     EXPECT_FALSE(tree.root()->right());
 }
 
+TEST(tree, flat_layout) {
+    const auto tree = kd::make_tree<kd::float2>(
+        kd::make_node(
+            kd::float2{ 1, 1 },
+            kd::make_leaf<kd::float2>(),
+            kd::make_node(
+                kd::float2{ 2, 2 },
+                kd::make_node(kd::float2{ 3, 3 }),
+                kd::make_leaf<kd::float2>()
+            )
+        )
+    );
+
+    const std::vector<kd::float2> expected_points{ {1, 1}, {2, 2}, {3, 3} };
+    const std::vector<kd::flat_node> expected_nodes{ {1, 0}, {3, 1}, {3, 0} };
+
+    EXPECT_EQ(tree.storage().points, expected_points);
+    EXPECT_EQ(tree.storage().nodes, expected_nodes);
+
+    EXPECT_FALSE(tree.root()->left());
+    EXPECT_TRUE(tree.root()->right());
+    EXPECT_EQ(tree.root()->right()->value(), (kd::float2{ 2, 2 }));
+    EXPECT_EQ(tree.root()->right()->left()->value(), (kd::float2{ 3, 3 }));
+    EXPECT_FALSE(tree.root()->right()->right());
+
+    EXPECT_EQ(tree.find_nearest({ 3, 2.9f }), (kd::float2{ 3, 3 }));
+}
+
 TEST(tree, equality) {
     const auto tree1 = kd::make_tree<kd::float2>(
         kd::make_node(
@@ -299,4 +335,677 @@ TEST(tree, find_nearest_n_4) {
     const auto actual_results{ tree.find_nearest_n({0.8f, -0.6f, 0.1f}, 4) };
 
     EXPECT_EQ(expected_results, actual_results);
-}
\ No newline at end of file
+}
+
+TEST(tree, build_bucket) {
+    const std::vector<kd::float2> points{
+        {2, 3},
+        {5, 4},
+        {9, 6},
+    };
+
+    const auto tree{ kd::tree<kd::float2>::build(points, 2, 4) };
+    const std::vector<kd::flat_node> expected_nodes{ {1}, {2}, {3} };
+
+    EXPECT_EQ(tree.leaf_size(), 4);
+    EXPECT_EQ(tree.storage().points, points);
+    EXPECT_EQ(tree.storage().nodes, expected_nodes);
+}
+
+TEST(tree, find_nearest_bucket) {
+    std::default_random_engine rng(42);
+    std::normal_distribution<float> nd;
+
+    std::vector<kd::float3> points(1000);
+    for (auto& p : points) {
+        p = { nd(rng), nd(rng), nd(rng) };
+    }
+
+    const auto expected_tree{ kd::build_tree(points) };
+
+    for (const size_t leaf_size : { 2, 8, 33, 2000 }) {
+        const auto actual_tree{ kd::build_tree(points, leaf_size) };
+
+        for (auto i = 0; i < 100; ++i) {
+            const kd::float3 key{ nd(rng), nd(rng), nd(rng) };
+            EXPECT_EQ(expected_tree.find_nearest(key), actual_tree.find_nearest(key));
+            EXPECT_EQ(expected_tree.find_nearest_n(key, 5), actual_tree.find_nearest_n(key, 5));
+        }
+    }
+}
+
+TEST(tree, find_nearest_soa) {
+    std::default_random_engine rng(42);
+    std::normal_distribution<float> nd;
+
+    std::vector<std::vector<float>> points(1000, std::vector<float>(5));
+    for (auto& p : points) {
+        std::ranges::generate(p, [&]() { return nd(rng); });
+    }
+
+    const auto aos_tree{ kd::tree<std::vector<float>>::build(points, 5, { .leaf_size = 16 }) };
+    const auto soa_tree{ kd::tree<std::vector<float>>::build(points, 5, {
+        .leaf_size = 16,
+        .layout = kd::coordinate_layout::soa }) };
+
+    const auto& coords = soa_tree.storage().coords;
+    for (auto axis = 0; axis < 5; ++axis) {
+        EXPECT_EQ(reinterpret_cast<std::uintptr_t>(coords.axis(axis)) % coords.alignment, 0);
+        EXPECT_EQ(coords.axis(axis)[123], soa_tree.storage().points[123][axis]);
+    }
+
+    EXPECT_TRUE(aos_tree.storage().coords.empty());
+    EXPECT_EQ(aos_tree, soa_tree);
+
+    for (auto i = 0; i < 100; ++i) {
+        std::vector<float> key(5);
+        std::ranges::generate(key, [&]() { return nd(rng); });
+        EXPECT_EQ(aos_tree.find_nearest(key), soa_tree.find_nearest(key));
+        EXPECT_EQ(aos_tree.find_nearest_n(key, 7), soa_tree.find_nearest_n(key, 7));
+    }
+}
+
+TEST(tree, build_parallel) {
+    std::default_random_engine rng(42);
+    std::normal_distribution<float> nd;
+
+    std::vector<kd::float3> points(100000);
+    for (auto& p : points) {
+        p = { nd(rng), nd(rng), nd(rng) };
+    }
+
+    const auto expected{ kd::build_tree(points) };
+    for (size_t threads : { 0, 2, 3, 8 }) {
+        EXPECT_EQ(kd::build_tree(points, { .threads = threads }), expected);
+        EXPECT_EQ(
+            kd::build_tree(points, { .leaf_size = 16, .threads = threads }),
+            kd::build_tree(points, { .leaf_size = 16 }));
+    }
+}
+
+TEST(tree, build_in_place) {
+    std::default_random_engine rng(42);
+    std::normal_distribution<float> nd;
+
+    std::vector<kd::float3> points(10000);
+    for (auto& p : points) {
+        p = { nd(rng), nd(rng), nd(rng) };
+    }
+
+    for (const auto method : { kd::build_method::select, kd::build_method::presort }) {
+        const kd::build_options options{ .leaf_size = 8, .method = method };
+        const auto expected{ kd::build_tree(points, options) };
+
+        auto moved = points;
+        const auto* data = moved.data();
+        const auto tree{ kd::build_tree(std::move(moved), options) };
+
+        EXPECT_EQ(tree, expected);
+        if (method == kd::build_method::select) {
+            EXPECT_EQ(tree.storage().points.data(), data);
+        }
+    }
+
+    EXPECT_TRUE(kd::build_tree(std::vector<kd::float3>{}).is_empty());
+}
+
+TEST(tree, find_nearest_batch) {
+    std::default_random_engine rng(42);
+    std::normal_distribution<float> nd;
+
+    std::vector<kd::float2> points(5000);
+    for (auto& p : points) {
+        p = { nd(rng), nd(rng) };
+    }
+
+    std::vector<kd::float2> keys(1000);
+    for (auto& p : keys) {
+        p = { 3 * nd(rng), 3 * nd(rng) };
+    }
+
+    const auto tree{ kd::build_tree(points, 8) };
+
+    std::vector<kd::float2> nearest;
+    std::vector<std::vector<kd::float2>> nearest_n;
+    for (const auto& key : keys) {
+        nearest.push_back(tree.find_nearest(key));
+        nearest_n.push_back(tree.find_nearest_n(key, 5));
+    }
+
+    for (size_t threads : { 1, 0, 4 }) {
+        for (size_t chunk_size : { 1, 7, 256, 5000 }) {
+            const kd::batch_options options{ .threads = threads, .chunk_size = chunk_size };
+            EXPECT_EQ(tree.find_nearest_batch(keys, options), nearest);
+            EXPECT_EQ(tree.find_nearest_n_batch(keys, 5, options), nearest_n);
+        }
+    }
+
+    std::vector<kd::float2> out(keys.size() + 1);
+    tree.find_nearest_batch(std::span(keys).first(10), out, { .threads = 2, .chunk_size = 3 });
+    EXPECT_TRUE(std::ranges::equal(std::span(out).first(10), std::span(nearest).first(10)));
+    EXPECT_EQ(out.back(), kd::float2{});
+
+    EXPECT_TRUE(tree.find_nearest_batch(std::vector<kd::float2>{}).empty());
+}
+
+TEST(tree, find_nearest_n_large) {
+    std::default_random_engine rng(42);
+    std::uniform_int_distribution<int> ud(-1000, 1000);
+
+    std::vector<kd::int2> points(3000);
+    for (auto& p : points) {
+        p = { ud(rng), ud(rng) };
+    }
+
+    const auto tree{ kd::build_tree(points, 8) };
+
+    for (auto i = 0; i < 20; ++i) {
+        const kd::int2 key{ ud(rng), ud(rng) };
+        const auto dist = [&key](const kd::int2& p) { return kd::detail::dist_sqr(key, p, 2); };
+
+        auto expected = points;
+        std::ranges::sort(expected, std::less(), dist);
+
+        for (size_t num : { 1, 32, 256, 3000, 5000 }) {
+            const auto actual = tree.find_nearest_n(key, num);
+            ASSERT_EQ(actual.size(), std::min(num, points.size()));
+            EXPECT_TRUE(std::ranges::is_sorted(actual, std::less(), dist));
+            for (size_t j = 0; j < actual.size(); ++j) {
+                EXPECT_EQ(dist(actual[j]), dist(expected[j]));
+            }
+        }
+    }
+}
+
+TEST(tree, find_nearest_neighbors) {
+    std::default_random_engine rng(42);
+    std::normal_distribution<float> nd;
+
+    std::vector<kd::float3> points(5000);
+    for (auto& p : points) {
+        p = { nd(rng), nd(rng), nd(rng) };
+    }
+
+    const auto tree{ kd::build_tree(points, 8) };
+    std::vector<kd::tree<kd::float3>::neighbor_type> out(20);
+
+    for (auto i = 0; i < 100; ++i) {
+        const kd::float3 key{ nd(rng), nd(rng), nd(rng) };
+
+        const auto nearest = tree.find_nearest_neighbor(key);
+        EXPECT_EQ(nearest.value, tree.find_nearest(key));
+        EXPECT_EQ(nearest.distance_sqr, kd::detail::dist_sqr(key, nearest.value, 3));
+
+        const auto expected{ tree.find_nearest_n(key, out.size()) };
+        ASSERT_EQ(tree.find_nearest_neighbors(key, out), expected.size());
+        for (size_t j = 0; j < expected.size(); ++j) {
+            EXPECT_EQ(out[j].value, expected[j]);
+            EXPECT_EQ(out[j].distance_sqr, kd::detail::dist_sqr(key, expected[j], 3));
+        }
+    }
+
+    // fewer points than out can hold
+    const auto small{ kd::build_tree({ kd::float3{ 0, 0, 0 }, kd::float3{ 1, 0, 0 } }) };
+    ASSERT_EQ(small.find_nearest_neighbors({ 2, 0, 0 }, out), 2);
+    EXPECT_EQ(out[0], (kd::tree<kd::float3>::neighbor_type{ { 1, 0, 0 }, 1 }));
+    EXPECT_EQ(out[1], (kd::tree<kd::float3>::neighbor_type{ { 0, 0, 0 }, 4 }));
+
+    const kd::tree<kd::float3> empty;
+    EXPECT_EQ(empty.find_nearest_neighbors({ 2, 0, 0 }, out), 0);
+    EXPECT_EQ(empty.find_nearest_neighbor({ 2, 0, 0 }).distance_sqr, std::numeric_limits<float>::max());
+}
+
+TEST(tree, erase) {
+    std::default_random_engine rng(42);
+    std::normal_distribution<float> nd;
+
+    std::vector<kd::float2> points(4000);
+    for (auto& p : points) {
+        p = { nd(rng), nd(rng) };
+    }
+
+    for (const auto layout : { kd::coordinate_layout::aos, kd::coordinate_layout::soa }) {
+        for (const size_t leaf_size : { 1, 8 }) {
+            auto tree{ kd::build_tree(points, { .leaf_size = leaf_size, .layout = layout, .compact_fraction = 0.75 }) };
+            auto live = points;
+            std::ranges::shuffle(live, rng);
+
+            EXPECT_FALSE(tree.erase({ 100, 100 }));
+
+            // erase just over three quarters, the last erase compacts the tree
+            while (live.size() >= points.size() / 4) {
+                ASSERT_TRUE(tree.erase(live.back()));
+                live.pop_back();
+                ASSERT_EQ(tree.size(), live.size());
+
+                if (live.size() % 100 == 0) {
+                    const kd::float2 key{ nd(rng), nd(rng) };
+                    const auto dist = [&key](const kd::float2& p) { return kd::detail::dist_sqr(key, p, 2); };
+                    const auto nearest = tree.find_nearest_neighbor(key);
+                    EXPECT_FLOAT_EQ(nearest.distance_sqr, dist(std::ranges::min(live, std::less(), dist)));
+
+                    auto expected = live;
+                    std::ranges::sort(expected, std::less(), dist);
+                    const auto found{ tree.find_nearest_n(key, 10) };
+                    ASSERT_EQ(found.size(), 10);
+                    for (size_t j = 0; j < found.size(); ++j) {
+                        EXPECT_FLOAT_EQ(dist(found[j]), dist(expected[j]));
+                    }
+
+                    EXPECT_EQ(tree.count_within_radius(key, 0.5f),
+                        size_t(std::ranges::count_if(live, [&](const kd::float2& p) { return dist(p) <= 0.25f; })));
+                }
+            }
+
+            EXPECT_TRUE(tree.storage().dead.empty());
+            EXPECT_EQ(tree.storage().points.size(), live.size());
+        }
+    }
+
+    auto single{ kd::build_tree({ kd::int2{ 1, 2 } }) };
+    EXPECT_TRUE(single.erase({ 1, 2 }));
+    EXPECT_TRUE(single.is_empty());
+    EXPECT_FALSE(single.erase({ 1, 2 }));
+}
+
+TEST(tree, find_within_radius) {
+    std::default_random_engine rng(42);
+    std::uniform_int_distribution<int> ud(-100, 100);
+
+    std::vector<kd::int2> points(2000);
+    for (auto& p : points) {
+        p = { ud(rng), ud(rng) };
+    }
+
+    const auto tree{ kd::build_tree(points) };
+    const auto bucket_tree{ kd::build_tree(points, 16) };
+
+    for (auto i = 0; i < 50; ++i) {
+        const kd::int2 key{ ud(rng), ud(rng) };
+        const auto radius = i % 25;
+        const auto dist = [&key](const kd::int2& p) { return kd::detail::dist_sqr(key, p, 2); };
+
+        std::vector<kd::int2> expected;
+        std::ranges::copy_if(points, std::back_inserter(expected),
+            [&](const kd::int2& p) { return dist(p) <= radius * radius; });
+        std::ranges::sort(expected);
+
+        auto actual = tree.find_within_radius(key, radius);
+        std::ranges::sort(actual);
+        EXPECT_EQ(actual, expected);
+
+        std::vector<kd::int2> bucket_actual;
+        bucket_tree.find_within_radius(key, radius, bucket_actual);
+        std::ranges::sort(bucket_actual);
+        EXPECT_EQ(bucket_actual, expected);
+
+        EXPECT_EQ(tree.count_within_radius(key, radius), expected.size());
+        EXPECT_EQ(bucket_tree.count_within_radius(key, radius), expected.size());
+    }
+
+    EXPECT_EQ(tree.count_within_radius({ 0, 0 }, -1), 0);
+    EXPECT_EQ(tree.count_within_radius({ 0, 0 }, 1000), points.size());
+}
+
+TEST(tree, visit_within_radius_soa) {
+    std::default_random_engine rng(42);
+    std::normal_distribution<double> nd;
+
+    std::vector<kd::double3> points(3000);
+    for (auto& p : points) {
+        p = { nd(rng), nd(rng), nd(rng) };
+    }
+
+    const auto tree{ kd::build_tree(points, { .leaf_size = 32, .layout = kd::coordinate_layout::soa }) };
+
+    for (auto i = 0; i < 50; ++i) {
+        const kd::double3 key{ nd(rng), nd(rng), nd(rng) };
+        const auto dist = [&key](const kd::double3& p) { return kd::detail::dist_sqr(key, p, 3); };
+
+        size_t expected = std::ranges::count_if(points, [&](const auto& p) { return dist(p) <= 0.25; });
+
+        size_t visited = 0;
+        tree.visit_within_radius(key, 0.5, [&](const kd::double3& p) {
+            EXPECT_LE(dist(p), 0.25);
+            ++visited;
+        });
+
+        EXPECT_EQ(visited, expected);
+        EXPECT_EQ(tree.count_within_radius(key, 0.5), expected);
+    }
+}
+
+TEST(tree, find_nearest_approx) {
+    std::default_random_engine rng(42);
+    std::normal_distribution<float> nd;
+
+    std::vector<std::vector<float>> points(5000, std::vector<float>(8));
+    for (auto& p : points) {
+        std::ranges::generate(p, [&]() { return nd(rng); });
+    }
+
+    const auto tree{ kd::tree<std::vector<float>>::build(points, 8, 8) };
+
+    for (const auto eps : { 0.0, 0.01, 0.5, 2.0 }) {
+        const auto scale = float((1 + eps) * (1 + eps)) * 1.0001f;
+
+        for (auto i = 0; i < 50; ++i) {
+            std::vector<float> key(8);
+            std::ranges::generate(key, [&]() { return nd(rng); });
+            const auto dist = [&key](const std::vector<float>& p) { return kd::detail::dist_sqr(key, p, 8); };
+
+            const auto exact = tree.find_nearest(key);
+            const auto approx = tree.find_nearest(key, eps);
+            EXPECT_LE(dist(approx), dist(exact) * scale);
+            if (eps == 0) {
+                EXPECT_EQ(approx, exact);
+            }
+
+            const auto exact_n = tree.find_nearest_n(key, 10);
+            const auto approx_n = tree.find_nearest_n(key, 10, eps);
+            ASSERT_EQ(approx_n.size(), exact_n.size());
+            for (size_t j = 0; j < exact_n.size(); ++j) {
+                EXPECT_LE(dist(approx_n[j]), dist(exact_n[j]) * scale);
+            }
+        }
+    }
+}
+
+TEST(tree, find_nearest_deep_tree) {
+    constexpr int depth = 100000;
+
+    auto root = kd::make_node(kd::double2{ depth, depth });
+    for (auto i = depth - 1; i >= 0; --i) {
+        root = kd::make_node(kd::double2{ double(i), double(i) }, kd::make_leaf<kd::double2>(), std::move(root));
+    }
+
+    const auto tree = kd::make_tree<kd::double2>(root);
+    EXPECT_EQ(tree.storage().nodes.size(), depth + 1);
+    EXPECT_EQ(tree.storage().nodes[0].right, 1);
+
+    EXPECT_EQ(tree.find_nearest({ depth / 2, depth / 2 + 0.25 }), (kd::double2{ depth / 2, depth / 2 }));
+    EXPECT_EQ(tree.find_nearest({ 2 * depth, 2 * depth }), (kd::double2{ depth, depth }));
+    EXPECT_EQ(tree.find_nearest_n({ 10, 10 }, 3), (std::vector<kd::double2>{ { 10, 10 }, { 9, 9 }, { 11, 11 } }));
+    EXPECT_EQ(tree.count_within_radius({ 0, 0 }, 15), 11);
+    EXPECT_EQ(tree.stats().max_depth, depth);
+}
+
+TEST(tree, search_stats) {
+    const auto tree = kd::make_tree<kd::float2>(
+        kd::make_node(
+            kd::float2{ 7, 2 },
+            kd::make_node(
+                kd::float2{ 5, 4 },
+                kd::make_node(kd::float2{ 2, 3 }),
+                kd::make_node(kd::float2{ 4, 7 })
+            ),
+            kd::make_node(
+                kd::float2{ 9, 6 },
+                kd::make_node(kd::float2{ 8, 1 }),
+                kd::make_leaf<kd::float2>()
+            )
+        )
+    );
+
+    // (7, 2) and (9, 6) on the way down to (8, 1), the left subtree of the
+    // root is pruned
+    kd::search_stats stats;
+    EXPECT_EQ(tree.find_nearest_neighbor({ 9, 2 }, stats).value, (kd::float2{ 8, 1 }));
+    EXPECT_EQ(stats.nodes_visited, 2);
+    EXPECT_EQ(stats.leaf_scans, 1);
+    EXPECT_EQ(stats.distance_evaluations, 3);
+    EXPECT_EQ(stats.far_descents, 0);
+    EXPECT_EQ(stats.max_stack_depth, 1);
+
+    // both far sides pending on the way down are searched after all
+    stats = {};
+    EXPECT_EQ(tree.find_nearest_neighbor({ 6, 5 }, stats).value, (kd::float2{ 5, 4 }));
+    EXPECT_EQ(stats.nodes_visited, 3);
+    EXPECT_EQ(stats.leaf_scans, 3);
+    EXPECT_EQ(stats.distance_evaluations, 6);
+    EXPECT_EQ(stats.far_descents, 2);
+    EXPECT_EQ(stats.max_stack_depth, 2);
+
+    // statistics add up over queries
+    EXPECT_EQ(tree.count_within_radius({ 6, 5 }, 100, stats), 6);
+    EXPECT_EQ(stats.distance_evaluations, 12);
+
+    std::default_random_engine rng(42);
+    std::normal_distribution<float> nd;
+
+    std::vector<kd::float2> points(10000);
+    for (auto& p : points) {
+        p = { nd(rng), nd(rng) };
+    }
+
+    for (const auto layout : { kd::coordinate_layout::aos, kd::coordinate_layout::soa }) {
+        const auto big{ kd::build_tree(points, { .leaf_size = 8, .layout = layout }) };
+
+        stats = {};
+        std::vector<kd::tree<kd::float2>::neighbor_type> out(10);
+        for (auto i = 0; i < 100; ++i) {
+            const kd::float2 key{ nd(rng), nd(rng) };
+            EXPECT_EQ(big.find_nearest_neighbor(key, stats), big.find_nearest_neighbor(key));
+            EXPECT_EQ(big.find_nearest_neighbors(key, out, stats), out.size());
+        }
+
+        // pruning leaves most of the tree alone
+        EXPECT_GT(stats.leaf_scans, 0);
+        EXPECT_LT(stats.distance_evaluations, 200 * points.size() / 20);
+        EXPECT_LE(stats.max_stack_depth, std::bit_width(points.size()));
+    }
+}
+
+TEST(tree, stats) {
+    EXPECT_EQ(kd::tree<kd::float2>().stats().leaves, 0);
+
+    std::default_random_engine rng(42);
+    std::normal_distribution<float> nd;
+
+    std::vector<kd::float3> points(1000);
+    for (auto& p : points) {
+        p = { nd(rng), nd(rng), nd(rng) };
+    }
+
+    auto tree{ kd::build_tree(points, { .leaf_size = 8 }) };
+    auto stats = tree.stats();
+    EXPECT_EQ(stats.size, 1000);
+    EXPECT_EQ(stats.live, 1000);
+    EXPECT_EQ(stats.max_depth, 7);
+    EXPECT_EQ(stats.balance, 1.0);
+    EXPECT_EQ(stats.split_nodes + stats.leaves, 2 * stats.split_nodes + 1);
+    EXPECT_GT(stats.average_leaf_depth, 6.0);
+    EXPECT_LE(stats.average_leaf_depth, 7.0);
+    EXPECT_EQ(stats.node_bytes, 1000 * sizeof(kd::flat_node));
+    EXPECT_EQ(stats.point_bytes, 1000 * sizeof(kd::float3));
+    EXPECT_EQ(stats.coordinate_bytes, 0);
+
+    // round robin, every level is full
+    ASSERT_EQ(stats.split_axes.size(), 7);
+    for (size_t depth = 0; depth < 7; ++depth) {
+        for (size_t axis = 0; axis < 3; ++axis) {
+            EXPECT_EQ(stats.split_axes[depth][axis], axis == depth % 3 ? size_t(1) << depth : 0);
+        }
+    }
+
+    std::ostringstream os;
+    os << stats;
+    EXPECT_EQ(os.str().find("{\"size\":1000,\"live\":1000,"), 0);
+    EXPECT_NE(os.str().find("\"split_axes\":[[1,0,0],[0,2,0],[0,0,4],"), std::string::npos);
+
+    tree.erase(points[0]);
+    stats = tree.stats();
+    EXPECT_EQ(stats.live, 999);
+    EXPECT_EQ(stats.node_bytes, 1000 * (sizeof(kd::flat_node) + 1 + sizeof(size_t)));
+
+    const auto soa{ kd::build_tree(points, { .layout = kd::coordinate_layout::soa }) };
+    EXPECT_EQ(soa.stats().coordinate_bytes, soa.storage().coords.values.size() * sizeof(float));
+
+    // a chain is as unbalanced as it gets
+    auto chain = kd::make_node(kd::float2{ 99, 99 });
+    for (auto i = 98; i >= 0; --i) {
+        chain = kd::make_node(kd::float2{ float(i), float(i) }, kd::make_leaf<kd::float2>(), std::move(chain));
+    }
+
+    stats = kd::make_tree<kd::float2>(chain).stats();
+    EXPECT_EQ(stats.split_nodes, 99);
+    EXPECT_EQ(stats.leaves, 1);
+    EXPECT_EQ(stats.max_depth, 99);
+    EXPECT_EQ(stats.average_leaf_depth, 99.0);
+    EXPECT_EQ(stats.balance, 99.0 / 6);
+}
+
+TEST(tree, static_kdim) {
+    static_assert(kd::static_kdim_point<kd::float2>);
+    static_assert(kd::static_kdim_point<kd::double3>);
+    static_assert(!kd::static_kdim_point<std::vector<float>>);
+    static_assert(std::same_as<kd::detail::kdim_type_t<kd::float3>, kd::detail::static_kdim<3>>);
+    static_assert(std::same_as<kd::detail::kdim_type_t<std::vector<float>>, int>);
+    static_assert(sizeof(kd::tree<kd::float3>) < sizeof(kd::tree<std::vector<float>>));
+
+    const kd::float3 a{ 1.5f, -2, 0.25f };
+    const kd::float3 b{ -3, 4.5f, 1 };
+    EXPECT_EQ(kd::detail::dist_sqr(a, b, kd::detail::static_kdim<3>{}), kd::detail::dist_sqr(a, b, 3));
+
+    const auto tree{ kd::build_tree({ a, b }) };
+    EXPECT_EQ(tree.kdim(), 3);
+    EXPECT_EQ(kd::make_tree<kd::float2>().kdim(), 2);
+    EXPECT_EQ(kd::tree<std::vector<float>>(5).kdim(), 5);
+}
+
+TEST(tree, static_kdim_mismatch) {
+    std::default_random_engine rng(42);
+    std::normal_distribution<float> nd;
+
+    std::vector<kd::float3> points(500);
+    for (auto& p : points) {
+        p = { nd(rng), nd(rng), nd(rng) };
+    }
+
+    for (const auto kdim : { 2, 4, -1 }) {
+        EXPECT_THROW(kd::tree<kd::float3>::build(points, kdim, { .layout = kd::coordinate_layout::soa }), std::invalid_argument);
+        EXPECT_THROW(kd::tree<kd::float3>{ kdim }, std::invalid_argument);
+        EXPECT_THROW(kd::tree<kd::float3>::build(std::vector<kd::float3>(), kdim), std::invalid_argument);
+    }
+
+    // the coordinates have a row for every axis of the type
+    const auto soa_tree{ kd::tree<kd::float3>::build(points, 3, { .leaf_size = 8, .layout = kd::coordinate_layout::soa }) };
+    const auto& coords = soa_tree.storage().coords;
+    EXPECT_GE(coords.values.size(), coords.stride * 3 + coords.lanes);
+    EXPECT_EQ(coords.axis(2)[123], soa_tree.storage().points[123][2]);
+
+    const auto aos_tree{ kd::build_tree(points, 8) };
+    for (auto i = 0; i < 50; ++i) {
+        const kd::float3 key{ nd(rng), nd(rng), nd(rng) };
+        EXPECT_EQ(soa_tree.find_nearest(key), aos_tree.find_nearest(key));
+    }
+}
+
+TEST(tree, find_nearest_runtime_kdim) {
+    std::default_random_engine rng(42);
+    std::normal_distribution<float> nd;
+
+    // dispatched to static dimensions and not
+    for (const auto kdim : { 2, 3, 5, 6, 16, 20, 32 }) {
+        std::vector<std::vector<float>> points(2000, std::vector<float>(kdim));
+        for (auto& p : points) {
+            std::ranges::generate(p, [&]() { return nd(rng); });
+        }
+
+        const auto tree{ kd::tree<std::vector<float>>::build(points, kdim, 4) };
+
+        const auto& packed = tree.storage().packed;
+        EXPECT_EQ(packed.stride, kdim <= 16 ? std::bit_ceil(size_t(kdim)) : (kdim + 15) / 16 * 16);
+        EXPECT_EQ(reinterpret_cast<std::uintptr_t>(packed.row(0)) % packed.alignment, 0);
+        EXPECT_TRUE(std::ranges::equal(std::span(packed.row(321), kdim), tree.storage().points[321]));
+
+        for (auto i = 0; i < 20; ++i) {
+            std::vector<float> key(kdim);
+            std::ranges::generate(key, [&]() { return nd(rng); });
+            const auto dist = [&key, kdim](const std::vector<float>& p) { return kd::detail::dist_sqr(key, p, kdim); };
+
+            const auto expected = std::ranges::min(points, std::less(), dist);
+            EXPECT_EQ(dist(tree.find_nearest(key)), dist(expected));
+
+            auto sorted = points;
+            std::ranges::partial_sort(sorted, sorted.begin() + 5, std::less(), dist);
+            const auto nearest_n = tree.find_nearest_n(key, 5);
+            for (size_t j = 0; j < 5; ++j) {
+                EXPECT_EQ(dist(nearest_n[j]), dist(sorted[j]));
+            }
+        }
+    }
+
+    // hand-made trees get the packed copy too
+    const auto tree = kd::tree<std::vector<float>>(
+        kd::make_node(std::vector<float>{ 0, 0 }, kd::make_node(std::vector<float>{ -1, 1 }), kd::make_node(std::vector<float>{ 1, 1 })), 2);
+    EXPECT_TRUE(std::ranges::equal(tree.storage().packed.values, std::vector<float>{ 0, 0, -1, 1, 1, 1 }));
+    EXPECT_EQ(tree.find_nearest({ 0.9f, 0.8f }), (std::vector<float>{ 1, 1 }));
+}
+
+TEST(tree, split_rules) {
+    std::default_random_engine rng(42);
+    std::normal_distribution<float> nd;
+    std::uniform_int_distribution<int> ud(0, 3);
+
+    // anisotropic, with duplicates
+    std::vector<kd::float2> points(20000);
+    for (auto& p : points) {
+        p = { 100 * nd(rng), float(ud(rng)) };
+    }
+
+    EXPECT_EQ(
+        kd::build_tree(points, { .split = kd::split_rule::round_robin }),
+        kd::build_tree(points));
+
+    for (const auto rule : { kd::split_rule::round_robin, kd::split_rule::widest_spread, kd::split_rule::sliding_midpoint }) {
+        for (const auto method : { kd::build_method::select, kd::build_method::presort }) {
+            for (const size_t leaf_size : { 1, 8 }) {
+                const kd::build_options options{ .leaf_size = leaf_size, .split = rule, .method = method };
+                const auto tree{ kd::build_tree(points, options) };
+                const auto& storage = tree.storage();
+
+                // every node separates its subtrees along its own axis
+                std::vector<std::pair<size_t, size_t>> subtrees{ { 0, storage.nodes.size() } };
+                while (!subtrees.empty()) {
+                    const auto [i, end] = subtrees.back();
+                    subtrees.pop_back();
+                    if (end - i <= leaf_size) continue;
+
+                    const auto& node = storage.nodes[i];
+                    const auto value = storage.points[i][node.axis];
+                    for (auto j = i + 1; j < node.right; ++j) {
+                        ASSERT_LE(storage.points[j][node.axis], value);
+                    }
+                    for (auto j = node.right; j < end; ++j) {
+                        ASSERT_GE(storage.points[j][node.axis], value);
+                    }
+
+                    if (i + 1 < node.right) subtrees.emplace_back(i + 1, node.right);
+                    if (node.right < end) subtrees.emplace_back(node.right, end);
+                }
+
+                if (rule != kd::split_rule::round_robin) {
+                    EXPECT_EQ(storage.nodes[0].axis, 0);
+                }
+
+                auto parallel = options;
+                parallel.threads = 4;
+                EXPECT_EQ(kd::build_tree(points, parallel), tree);
+
+                for (auto i = 0; i < 50; ++i) {
+                    const kd::float2 key{ 100 * nd(rng), 3 * nd(rng) };
+                    const auto dist = [&key](const kd::float2& p) { return kd::detail::dist_sqr(key, p, 2); };
+                    EXPECT_EQ(dist(tree.find_nearest(key)), dist(std::ranges::min(points, std::less(), dist)));
+                }
+            }
+        }
+    }
+
+    // both methods pick the same medians, only equal coordinates may land
+    // in other subtrees
+    const auto select{ kd::build_tree(points) };
+    const auto presort{ kd::build_tree(points, { .method = kd::build_method::presort }) };
+    EXPECT_EQ(select.storage().nodes, presort.storage().nodes);
+    EXPECT_TRUE(std::ranges::is_permutation(select.storage().points, presort.storage().points));
+}